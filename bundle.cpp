@@ -0,0 +1,108 @@
+/*
+ * Bundle program
+ *
+ * This program decodes images once and writes them to a bundle, with the planes and spectra the patch matching of the
+ * texture program computes from its sample, so that the texture and montage programs start by mapping the bundle
+ * instead of decoding the images and transforming the sample.
+ *
+ * Parameters:
+ *      i: number of input images and their name, the planes are computed for the first one
+ *      o: path to the output bundle, whose name must end with .bundle
+ *      p: number of levels of the pyramids of the images, each half the size of the previous one (none by default)
+ *      r: rotation range of the sub-patch matching to precompute, -1 for none (0 by default)
+ *      h: height of the texture whose entire patch matching is precomputed (none by default)
+ *      w: width of the texture whose entire patch matching is precomputed (none by default)
+ *
+ * Usage:
+ *      bundle -i [number_of_images] [image_1] .. [image_n] -o [output_file] -p [levels] -r [rotation_range]
+ *             -h [height] -w [width]
+ *
+ * Ex:
+ *      bundle -i 1 samples/floor.jpg -o samples/floor.bundle -r 0 -h 256 -w 256
+ *      texture -i samples/floor.bundle -o results/floor.jpg -h 256 -w 256 -m 2
+ */
+
+#include <iostream>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "patch_match.h"
+#include "source_bundle.h"
+
+using namespace std;
+using namespace cv;
+
+int main(int argc, char** argv) {
+
+    // reading the parameters
+
+    vector<string> input_files;
+    string output_file;
+    int levels = 0;
+    int range = 0;
+    int height = 0;
+    int width = 0;
+
+    for (int i = 1; i < argc; i++)
+        switch (argv[i][1]) {
+            case 'i': { // input files
+                int num_files = atoi(argv[++i]);
+                for (int _i = 0; _i < num_files && i + 1 < argc; _i++)
+                    input_files.push_back(argv[++i]);
+                break;
+            }
+            case 'o': // output file
+                output_file = argv[++i];
+                break;
+            case 'p':
+                levels = atoi(argv[++i]);
+                break;
+            case 'r':
+                range = atoi(argv[++i]);
+                break;
+            case 'h':
+                height = atoi(argv[++i]);
+                break;
+            case 'w':
+                width = atoi(argv[++i]);
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+
+    if (input_files.empty() || !is_bundle(output_file) || levels < 0 || height < 0 || width < 0)
+        return EXIT_FAILURE;
+
+    // the images and their pyramids
+
+    SourceBundle bundle;
+    vector<Mat> images;
+    for (size_t k = 0; k < input_files.size(); k++) {
+        Mat image = imread(input_files[k], IMREAD_COLOR);
+        if (image.empty()) {
+            cerr << "cannot read " << input_files[k] << endl;
+            return EXIT_FAILURE;
+        }
+        string name = "image/" + to_string(k);
+        bundle.add(name, image);
+        for (int l = 1; l <= levels && image.rows > 1 && image.cols > 1; l++) {
+            resize(image, image, Size(image.cols / 2, image.rows / 2), 0, 0, INTER_AREA);
+            bundle.add(name + "/" + to_string(l), image);
+        }
+        images.push_back(bundle.get(name));
+    }
+
+    // the planes of the patch matching of the texture program, which uses a canvas of 5/3 of the texture
+
+    if (range >= 0)
+        SubPatchMatcher(images[0], range).store(bundle);
+    if (height > 0 && width > 0)
+        PatchMatcher(images[0], Size(width + width / 3 * 2, height + height / 3 * 2)).store(bundle);
+
+    if (!bundle.write(output_file)) {
+        cerr << "cannot write " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+    cout << "wrote " << bundle.images() << " images to " << output_file << endl;
+
+    return EXIT_SUCCESS;
+}
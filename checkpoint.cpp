@@ -0,0 +1,225 @@
+//
+// Binary checkpoint of a montage session, written in the background and mapped back on load
+//
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+static const size_t page = 4096;
+static const char magic[8] = {'M', 'O', 'N', 'T', 'A', 'G', 'E', 'C'};
+
+struct Header {
+    char magic[8];
+    unsigned version;
+    int shift;
+    long long fields, size; // offset and size of the fields after the pages
+};
+
+// Fields appended to a buffer, then read back in the same order with bounds checks
+
+struct Fields {
+    vector<char> buffer;
+    size_t at = 0;
+    bool valid = true;
+
+    template <typename T>
+    void put(const T &value) {
+        const char *p = (const char *)&value;
+        buffer.insert(buffer.end(), p, p + sizeof(T));
+    }
+
+    template <typename T>
+    T get() {
+        T value = T();
+        if (at + sizeof(T) > buffer.size()) {
+            valid = false;
+            return value;
+        }
+        memcpy(&value, &buffer[at], sizeof(T));
+        at += sizeof(T);
+        return value;
+    }
+
+    void put(const pair<int,int> &value) {
+        put(value.first);
+        put(value.second);
+    }
+
+    pair<int,int> get_pair() {
+        int first = get<int>();
+        return make_pair(first, get<int>());
+    }
+
+    // number of items of the given size which follow, 0 if there cannot be that many
+    size_t count(size_t item) {
+        int n = get<int>();
+        if (n < 0 || size_t(n) * item > buffer.size() - at) {
+            valid = false;
+            return 0;
+        }
+        return size_t(n);
+    }
+};
+
+static bool pad(FILE *f, long long &end) {
+    static const char zeros[page] = {};
+    size_t n = size_t((page - end % page) % page);
+    end += n;
+    return n == 0 || fwrite(zeros, n, 1, f) == 1;
+}
+
+bool write_checkpoint(const string &path, const Checkpoint &c) {
+    string temporary = path + ".tmp";
+    FILE *f = fopen(temporary.c_str(), "wb");
+    if (!f)
+        return false;
+
+    Header header;
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = Checkpoint::version;
+    header.shift = c.tiles.shift;
+    long long end = 0;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    end += sizeof(header);
+    ok = ok && pad(f, end);
+
+    // the written tiles then the images, one after the other at page boundaries
+
+    Fields fields;
+    vector<uchar> buffer(c.tiles.bytes);
+    fields.put((long long)c.tiles.data.size());
+    for (size_t t = 0; t < c.tiles.data.size() && ok; t++) {
+        if (!c.tiles.read(int(t), buffer.data())) {
+            fields.put(-1LL);
+            continue;
+        }
+        fields.put(end);
+        ok = fwrite(buffer.data(), buffer.size(), 1, f) == 1;
+        end += (long long)buffer.size();
+        ok = ok && pad(f, end);
+    }
+    fields.put(int(c.images.size()));
+    for (size_t i = 0; i < c.images.size() && ok; i++) {
+        const Mat &image = c.images[i];
+        CV_Assert(image.type() == CV_8UC3);
+        fields.put(image.rows);
+        fields.put(image.cols);
+        fields.put(end);
+        for (int row = 0; row < image.rows && ok; row++)
+            ok = fwrite(image.ptr(row), image.cols * image.elemSize(), 1, f) == 1;
+        end += (long long)(image.total() * image.elemSize());
+        ok = ok && pad(f, end);
+    }
+
+    fields.put(c.rows);
+    fields.put(c.cols);
+    fields.put(c.extra_row);
+    fields.put(c.extra_col);
+    fields.put(int(c.photos.size()));
+    for (const Checkpoint::Photo &p : c.photos)
+        fields.put(p);
+    fields.put(int(c.offsets.size()));
+    for (const pair<int,int> &o : c.offsets)
+        fields.put(o);
+    fields.put(int(c.sources.size()));
+    for (const Checkpoint::Source &s : c.sources)
+        fields.put(s);
+    fields.put(int(c.owner.size()));
+    for (const pair<int,int> &o : c.owner)
+        fields.put(o);
+    fields.put((long long)c.state.size());
+    fields.buffer.insert(fields.buffer.end(), c.state.begin(), c.state.end());
+
+    header.fields = end;
+    header.size = (long long)fields.buffer.size();
+    ok = ok && fwrite(fields.buffer.data(), fields.buffer.size(), 1, f) == 1;
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool read_checkpoint(const string &path, Checkpoint &c) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *address = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header))
+        address = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        return false;
+    size_t length = size_t(st.st_size);
+    shared_ptr<uchar> mapping((uchar *)address, [length](uchar *p) { munmap(p, length); });
+
+    Header header;
+    memcpy(&header, mapping.get(), sizeof(header));
+    if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != Checkpoint::version
+        || header.shift < 1 || header.shift > 12 || header.fields < 0 || header.size < 0
+        || size_t(header.fields) > length || size_t(header.size) > length - size_t(header.fields))
+        return false;
+    Fields fields;
+    fields.buffer.assign(mapping.get() + header.fields, mapping.get() + header.fields + header.size);
+
+    // the pages read from the mapping must lie within the file
+
+    auto inside = [&](long long offset, size_t bytes) {
+        return offset >= 0 && size_t(offset) + bytes <= length;
+    };
+    TileSnapshot &tiles = c.tiles;
+    tiles.shift = header.shift;
+    tiles.bytes = (size_t(1) << (2 * header.shift)) * (sizeof(int) + sizeof(Vec3b));
+    long long count = fields.get<long long>();
+    if (count < 0 || size_t(count) > length / sizeof(long long))
+        return false;
+    tiles.data.assign(size_t(count), shared_ptr<uchar>());
+    tiles.slot.assign(size_t(count), -1);
+    tiles.mapped.assign(size_t(count), NULL);
+    for (long long t = 0; t < count && fields.valid; t++) {
+        long long offset = fields.get<long long>();
+        if (offset >= 0 && !inside(offset, tiles.bytes))
+            return false;
+        if (offset >= 0)
+            tiles.mapped[t] = mapping.get() + offset;
+    }
+    size_t images = fields.count(2 * sizeof(int) + sizeof(long long));
+    for (size_t i = 0; i < images && fields.valid; i++) {
+        int rows = fields.get<int>(), cols = fields.get<int>();
+        long long offset = fields.get<long long>();
+        if (rows < 0 || cols < 0 || !inside(offset, size_t(rows) * cols * 3))
+            return false;
+        c.images.push_back(Mat(rows, cols, CV_8UC3, mapping.get() + offset));
+    }
+
+    c.rows = fields.get<int>();
+    c.cols = fields.get<int>();
+    c.extra_row = fields.get<int>();
+    c.extra_col = fields.get<int>();
+    c.photos.resize(fields.count(sizeof(Checkpoint::Photo)));
+    for (Checkpoint::Photo &p : c.photos)
+        p = fields.get<Checkpoint::Photo>();
+    c.offsets.resize(fields.count(2 * sizeof(int)));
+    for (pair<int,int> &o : c.offsets)
+        o = fields.get_pair();
+    c.sources.resize(fields.count(sizeof(Checkpoint::Source)));
+    for (Checkpoint::Source &s : c.sources)
+        s = fields.get<Checkpoint::Source>();
+    c.owner.resize(fields.count(2 * sizeof(int)));
+    for (pair<int,int> &o : c.owner)
+        o = fields.get_pair();
+    long long state = fields.get<long long>();
+    if (!fields.valid || state < 0 || fields.at + size_t(state) > fields.buffer.size())
+        return false;
+    c.state.assign(fields.buffer.data() + fields.at, size_t(state));
+
+    tiles.rows = c.rows;
+    tiles.cols = c.cols;
+    tiles.mapping = mapping;
+    c.mapping = mapping;
+    return true;
+}
@@ -0,0 +1,53 @@
+//
+// Binary checkpoint of a montage session, written in the background and mapped back on load
+//
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "tiled_canvas.h"
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Everything a Montage needs to go on from where it stopped, and an opaque state of the caller such as its random
+ * generator. The file holds a header page, the written tiles of the nap and the images (samples of the sources and
+ * photos added as pixels) at page aligned offsets, then the other fields. Numbers are in the native byte order: a
+ * checkpoint is meant to resume a job on the same kind of machine.
+ *
+ * On load the file is mapped: the tiles and the images are read from the mapping, the pages are only read when the
+ * montage first touches them.
+ */
+struct Checkpoint {
+    static const unsigned version = 1;
+
+    struct Photo {
+        int source, width, height, rotation; // as in Montage::Patch
+        Rect crop;
+        int image; // index in images of the pixels of a photo added as pixels, -1 for a patch of a source
+    };
+
+    struct Source {
+        int image;
+        long long budget; // of the TransformCache
+    };
+
+    int rows = 0, cols = 0, extra_row = 0, extra_col = 0;
+    vector<Photo> photos;
+    vector<pair<int,int> > offsets; // of the photos placed so far
+    vector<Source> sources;
+    vector<Mat> images; // CV_8UC3
+    vector<pair<int,int> > owner; // constrained pixel, by row * cols + col, and the photo imposed on it
+    string state;
+    TileSnapshot tiles;
+    shared_ptr<uchar> mapping; // of the file, which the images and the tiles may be read from
+};
+
+bool write_checkpoint(const string &path, const Checkpoint &c); // to path.tmp, renamed to path once complete
+bool read_checkpoint(const string &path, Checkpoint &c); // false if the file is missing or not a valid checkpoint
+
+#endif //CHECKPOINT_H
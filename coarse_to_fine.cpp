@@ -0,0 +1,236 @@
+//
+// Multi-resolution cut of the seam graphs, for large overlaps
+//
+
+#include <algorithm>
+#include <climits>
+#include "coarse_to_fine.h"
+
+static inline int saturate(long long a) {
+    return int(min(a, (long long)infinity));
+}
+
+void distance_line(int *d, int n, int stride) {
+    for (int k = 1; k < n; k++)
+        d[k * stride] = min(d[k * stride], d[(k - 1) * stride] + 1);
+    for (int k = n - 2; k >= 0; k--)
+        d[k * stride] = min(d[k * stride], d[(k + 1) * stride] + 1);
+}
+
+void CutGap::add(long long cut_cost, long long full_cost) {
+    lock_guard<mutex> guard(lock);
+    cost += cut_cost;
+    optimum += full_cost;
+    cuts++;
+}
+
+double CutGap::excess() {
+    lock_guard<mutex> guard(lock);
+    return optimum > 0 ? double(cost - optimum) / optimum : 0;
+}
+
+CoarseToFineSolver::CoarseToFineSolver(Solver_Type type, Solver_Type reference, int levels, int band,
+                                       shared_ptr<CutGap> gap):
+        levels(max(levels, 1)), band(max(band, 1)), solver(make_solver(type, reference)), gap(gap) {
+    if (gap)
+        full = make_solver(type);
+}
+
+/*
+ * Give a node of this level to every block of the patch which has to be solved again, and to the nodes inside: the
+ * blocks within band blocks of a seam of the labels, or all of them on the first level. The other nodes keep their
+ * label, unless a constraint imposes the other one.
+ */
+void CoarseToFineSolver::free_nodes(const GridGraph &grid, int block, bool everywhere) {
+    int rows = grid.rows, cols = grid.cols;
+    coarse.reset((rows + block - 1) / block, (cols + block - 1) / block);
+    fill(coarse.node.begin(), coarse.node.end(), -1);
+
+    if (everywhere) {
+        for (int i = 0; i < grid.num_pixel; i++)
+            coarse.node[(grid.pixel[i].first / block) * coarse.cols + grid.pixel[i].second / block] = 0;
+    } else {
+        // Chebyshev distance to the pixels on both sides of a seam, one row then one column at a time
+
+        int radius = band * block, far = radius + 1;
+        plane.assign(size_t(rows) * cols, far);
+        for (int i = 0; i < grid.num_pixel; i++) {
+            int row = grid.pixel[i].first, col = grid.pixel[i].second, p = row * cols + col;
+            int right = col + 1 < cols ? grid.node[p + 1] : -1;
+            int down = row + 1 < rows ? grid.node[p + cols] : -1;
+            if (right >= 0 && label[right] != label[i])
+                plane[p] = plane[p + 1] = 0;
+            if (down >= 0 && label[down] != label[i])
+                plane[p] = plane[p + cols] = 0;
+        }
+        for (int row = 0; row < rows; row++)
+            distance_line(&plane[size_t(row) * cols], cols, 1);
+        for (int &d : plane)
+            d = d <= radius ? 0 : far;
+        for (int col = 0; col < cols; col++)
+            distance_line(&plane[col], rows, cols);
+
+        for (int i = 0; i < grid.num_pixel; i++) {
+            int row = grid.pixel[i].first, col = grid.pixel[i].second;
+            if (plane[row * cols + col] <= radius)
+                coarse.node[(row / block) * coarse.cols + col / block] = 0;
+        }
+    }
+
+    // blocks in row-major order, then the seams whose pixels are both free on the last level
+
+    int num_block = 0;
+    coarse.pixel.clear();
+    for (int row = 0; row < coarse.rows; row++)
+        for (int col = 0; col < coarse.cols; col++)
+            if (coarse.node[row * coarse.cols + col] >= 0) {
+                coarse.node[row * coarse.cols + col] = num_block++;
+                coarse.pixel.push_back(make_pair(row, col));
+            }
+    coarse.num_pixel = num_block;
+
+    group.resize(grid.node_num());
+    for (int i = 0; i < grid.num_pixel; i++)
+        group[i] = coarse.node[(grid.pixel[i].first / block) * coarse.cols + grid.pixel[i].second / block];
+    int num_seam = 0;
+    for (int k = 0; k < grid.num_seam; k++) {
+        int first = group[seam_first[k]], second = group[seam_second[k]];
+        if (block > 1)
+            group[grid.num_pixel + k] = first;
+        else
+            group[grid.num_pixel + k] = first >= 0 && second >= 0 ? num_block + num_seam++ : -1;
+    }
+    coarse.num_seam = num_seam;
+
+    for (int i = 0; i < grid.node_num(); i++)
+        if (group[i] < 0 && (grid.source[i] >= infinity) != (grid.sink[i] >= infinity))
+            label[i] = grid.sink[i] >= infinity;
+}
+
+/*
+ * The terminal weights of the nodes of a block are summed, saturated so that the constraints stay infinite, and so
+ * are the capacities between two neighbouring blocks. An edge to a node whose label is kept is cut when the free node
+ * takes the other label, it becomes a terminal weight of that node.
+ */
+void CoarseToFineSolver::contract(const GridGraph &grid, int block) {
+    int n = coarse.node_num();
+    coarse.source.assign(n, 0);
+    coarse.sink.assign(n, 0);
+    coarse.edges.clear();
+    for (int i = 0; i < grid.node_num(); i++) {
+        int g = group[i];
+        if (g >= 0) {
+            coarse.source[g] = saturate((long long)coarse.source[g] + grid.source[i]);
+            coarse.sink[g] = saturate((long long)coarse.sink[g] + grid.sink[i]);
+        }
+    }
+
+    if (block > 1)
+        for (vector<int> &c : cap)
+            c.assign(n, 0);
+
+    for (const GridEdge &e : grid.edges) {
+        int gi = group[e.i], gj = group[e.j];
+        if (gi < 0 && gj < 0)
+            continue;
+        if (gi < 0) {
+            if (label[e.i])
+                coarse.sink[gj] = saturate((long long)coarse.sink[gj] + e.rev_cap);
+            else
+                coarse.source[gj] = saturate((long long)coarse.source[gj] + e.cap);
+        } else if (gj < 0) {
+            if (label[e.j])
+                coarse.sink[gi] = saturate((long long)coarse.sink[gi] + e.cap);
+            else
+                coarse.source[gi] = saturate((long long)coarse.source[gi] + e.rev_cap);
+        } else if (gi == gj) {
+            continue;
+        } else if (block == 1) {
+            coarse.edges.push_back(e);
+            coarse.edges.back().i = gi;
+            coarse.edges.back().j = gj;
+        } else {
+            // slot 0 and 1 for the right and down neighbours, 2 and 3 for the reverse capacities
+            bool vertical = coarse.pixel[gi].second == coarse.pixel[gj].second;
+            bool forward = vertical ? coarse.pixel[gj].first > coarse.pixel[gi].first
+                                    : coarse.pixel[gj].second > coarse.pixel[gi].second;
+            int g = forward ? gi : gj;
+            cap[vertical][g] += forward ? e.cap : e.rev_cap;
+            cap[2 + vertical][g] += forward ? e.rev_cap : e.cap;
+        }
+    }
+
+    if (block > 1)
+        for (int g = 0; g < coarse.num_pixel; g++) {
+            int row = coarse.pixel[g].first, col = coarse.pixel[g].second;
+            int right = col + 1 < coarse.cols ? coarse.node[row * coarse.cols + col + 1] : -1;
+            int down = row + 1 < coarse.rows ? coarse.node[(row + 1) * coarse.cols + col] : -1;
+            if (right >= 0 && (cap[0][g] || cap[2][g]))
+                coarse.edges.push_back(GridEdge(g, right, cap[0][g], cap[2][g]));
+            if (down >= 0 && (cap[1][g] || cap[3][g]))
+                coarse.edges.push_back(GridEdge(g, down, cap[1][g], cap[3][g]));
+        }
+}
+
+// Capacity of the cut given by the labels
+long long CoarseToFineSolver::cost(const GridGraph &grid, const vector<char> &labels) const {
+    long long total = 0;
+    for (int i = 0; i < grid.node_num(); i++)
+        total += labels[i] ? grid.source[i] : grid.sink[i];
+    for (const GridEdge &e : grid.edges)
+        if (labels[e.i] != labels[e.j])
+            total += labels[e.j] ? e.cap : e.rev_cap;
+    return total;
+}
+
+int CoarseToFineSolver::solve(const GridGraph &grid, int threads) {
+    label.assign(grid.node_num(), 0);
+    seam_first.resize(grid.num_seam);
+    seam_second.resize(grid.num_seam);
+    for (const GridEdge &e : grid.edges) {
+        if (e.j >= grid.num_pixel)
+            seam_first[e.j - grid.num_pixel] = e.i;
+        else if (e.i >= grid.num_pixel)
+            seam_second[e.i - grid.num_pixel] = e.j;
+    }
+
+    for (int level = levels - 1; level >= 0; level--) {
+        int block = 1 << level;
+        free_nodes(grid, block, level == levels - 1);
+        if (coarse.node_num() == 0)
+            continue;
+        contract(grid, block);
+        solver->solve(coarse, threads);
+        if (cancelled())
+            return 0;
+        for (int i = 0; i < grid.node_num(); i++)
+            if (group[i] >= 0)
+                label[i] = solver->is_sink(group[i]);
+    }
+
+    long long total = cost(grid, label);
+    if (gap) {
+        full->solve(grid, threads);
+        full_label.resize(grid.node_num());
+        for (int i = 0; i < grid.node_num(); i++)
+            full_label[i] = full->is_sink(i);
+        gap->add(total, cost(grid, full_label));
+    }
+    return int(min(total, (long long)INT_MAX));
+}
+
+void CoarseToFineSolver::set_cancel(const atomic<bool> *flag) {
+    cancel = flag;
+    solver->set_cancel(flag);
+    if (full)
+        full->set_cancel(flag);
+}
+
+size_t CoarseToFineSolver::memory() const {
+    size_t bytes = coarse.memory() + solver->memory() + (full ? full->memory() : 0) + label.capacity() +
+                   full_label.capacity() + (group.capacity() + seam_first.capacity() + seam_second.capacity() +
+                   plane.capacity()) * sizeof(int);
+    for (const vector<int> &c : cap)
+        bytes += c.capacity() * sizeof(int);
+    return bytes;
+}
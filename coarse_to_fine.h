@@ -0,0 +1,58 @@
+//
+// Multi-resolution cut of the seam graphs, for large overlaps
+//
+
+#ifndef COARSE_TO_FINE_H
+#define COARSE_TO_FINE_H
+
+#include <mutex>
+#include "cut_solver.h"
+
+// Distances along a line of n values spaced by stride to the values at 0, the others must start above them
+void distance_line(int *d, int n, int stride);
+
+// Total cost of the coarse-to-fine cuts and of the full resolution cuts of the same graphs
+struct CutGap {
+    mutex lock;
+    long long cost = 0, optimum = 0;
+    int cuts = 0;
+
+    void add(long long cut_cost, long long full_cost);
+    double excess(); // relative excess of the coarse-to-fine cuts over the full resolution ones
+};
+
+/*
+ * The graph is contracted into blocks of 2^(levels-1) pixels, every seam node going with its first pixel, and the cut
+ * of this small graph is solved. Each following level halves the blocks and only solves again the ones within band
+ * blocks of a seam of the previous labels; the other nodes keep their label and their edges to the free nodes become
+ * terminal weights. The last level is the GridGraph itself restricted to the band, with its seam nodes.
+ *
+ * The contractions are GridGraphs of 4-connected blocks, so any engine solves them. The result is a cut of the full
+ * graph, not always a minimum one: when a gap is given, the full graph is solved as well and both costs are added.
+ */
+class CoarseToFineSolver : public CutSolver {
+    int levels, band;
+    unique_ptr<CutSolver> solver, full;
+    shared_ptr<CutGap> gap;
+
+    GridGraph coarse; // graph of the current level
+    vector<char> label, full_label; // 1 for the nodes in the sink segment
+    vector<int> group; // node of the current level of every node, -1 if its label is kept
+    vector<int> seam_first, seam_second; // pixel nodes on both sides of every seam node
+    vector<int> plane; // distances to the seams over the patch
+    vector<int> cap[4]; // capacities between neighbouring blocks, right and down then their reverse
+
+public:
+    CoarseToFineSolver(Solver_Type type, Solver_Type reference, int levels, int band, shared_ptr<CutGap> gap);
+    int solve(const GridGraph &grid, int threads = 1);
+    bool is_sink(int i) const { return label[i] != 0; }
+    size_t memory() const;
+    void set_cancel(const atomic<bool> *flag);
+
+private:
+    void free_nodes(const GridGraph &grid, int block, bool everywhere); // fill group for this level
+    void contract(const GridGraph &grid, int block); // build coarse from group
+    long long cost(const GridGraph &grid, const vector<char> &labels) const;
+};
+
+#endif //COARSE_TO_FINE_H
@@ -0,0 +1,185 @@
+//
+// Background thread recomposing a montage for the interactive tool, the latest request wins
+//
+
+#include <cstdio>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "compositor.h"
+
+Compositor::Compositor(Montage &montage, Montage *preview, int factor, int idle):
+        montage(montage), preview(factor > 1 ? preview : NULL), factor(factor), idle(idle), cancel(false) {
+    montage.set_cancel(&cancel);
+    if (this->preview)
+        this->preview->set_cancel(&cancel);
+    worker = thread([this]() { run(); });
+}
+
+Compositor::~Compositor() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        cancel = true;
+    }
+    wake.notify_one();
+    worker.join();
+    montage.set_cancel(NULL);
+    if (preview)
+        preview->set_cancel(NULL);
+}
+
+void Compositor::submit(const vector<Placement> &placements, const vector<set<pair<int,int>>> &constraints) {
+    {
+        lock_guard<mutex> guard(lock);
+        request = Request{placements, constraints, Clock::now(), false, 0};
+        pending = true;
+        flush = false;
+        unsettled = true;
+        cancel = true;
+    }
+    wake.notify_one();
+}
+
+void Compositor::step(int direction) {
+    {
+        lock_guard<mutex> guard(lock);
+        if (pending && request.step)
+            direction += request.direction;
+        else if (unsettled)
+            direction = 0; // only drop the edit in progress
+        request = Request{vector<Placement>(), vector<set<pair<int,int>>>(), Clock::now(), true, direction};
+        pending = true;
+        waiting = false;
+        unsettled = false;
+        cancel = true;
+    }
+    wake.notify_one();
+}
+
+bool Compositor::stepped(vector<Placement> &placements, vector<set<pair<int,int>>> &constraints) {
+    lock_guard<mutex> guard(lock);
+    if (!restoring)
+        return false;
+    restoring = false;
+    placements = restored.placements;
+    constraints = restored.constraints;
+    return true;
+}
+
+/*
+ * A new request is cut on the preview if there is one, and kept as the deferred one, whose full resolution cut starts
+ * once the last request is idle ms old
+ */
+void Compositor::run() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        wake.wait(guard, [this]() { return pending || waiting || stopping; });
+        if (stopping)
+            return;
+        bool full = !pending;
+        if (full && !flush && Clock::now() < deferred.submitted + idle) {
+            wake.wait_until(guard, deferred.submitted + idle);
+            continue;
+        }
+
+        Request r;
+        if (full) {
+            r = move(deferred);
+            waiting = false;
+        } else {
+            r = move(request);
+            pending = false;
+        }
+        bool scaled = !full && preview && !r.step;
+        if (scaled) {
+            deferred = r;
+            waiting = true;
+        }
+        busy = true;
+        cancel = false;
+        guard.unlock();
+
+        // a request submitted meanwhile cancels this one, unless it was already complete
+
+        Mat m, i;
+        bool complete = compose(scaled ? *preview : montage, r, scaled, m, i);
+
+        guard.lock();
+        if (complete) {
+            mask = m;
+            image = i;
+            submitted = r.submitted;
+            fresh = true;
+            coarse = scaled;
+            if (r.step) {
+                restored = move(r);
+                restoring = true;
+            } else if (!scaled && !pending) {
+                unsettled = false;
+            }
+        }
+        busy = false;
+        if (!pending && !waiting)
+            done.notify_all();
+    }
+}
+
+bool Compositor::compose(Montage &m, Request &r, bool scaled, Mat &m_mask, Mat &m_image) {
+    if (r.step) {
+        if (!m.step(r.direction, r.placements, r.constraints))
+            return false;
+        m.render(m_mask, m_image);
+        return true;
+    }
+    if (!scaled) {
+        if (m.recompose(r.placements, r.constraints) < 0)
+            return false;
+        m.render(m_mask, m_image);
+        return true;
+    }
+
+    // positions and constrained pixels scaled down, the pixels stay within the scaled photos
+
+    vector<Placement> placements;
+    vector<set<pair<int,int>>> constraints(r.constraints.size());
+    for (const Placement &p : r.placements) {
+        placements.push_back(Placement(p.index, p.row / factor, p.col / factor));
+        Size size = m.photo_size(p.index);
+        for (const pair<int,int> &q : r.constraints[p.index])
+            constraints[p.index].insert(make_pair(min(q.first / factor, size.height - 1),
+                                                  min(q.second / factor, size.width - 1)));
+    }
+    if (m.recompose(placements, constraints) < 0)
+        return false;
+    Mat small_mask, small_image;
+    m.render(small_mask, small_image);
+    resize(small_mask, m_mask, montage.canvas_size(), 0, 0, INTER_NEAREST);
+    resize(small_image, m_image, montage.canvas_size(), 0, 0, INTER_NEAREST);
+    return true;
+}
+
+bool Compositor::present() {
+    Mat m, i;
+    {
+        lock_guard<mutex> guard(lock);
+        if (!fresh)
+            return false;
+        fresh = false;
+        m = mask;
+        i = image.clone(); // the latency is written on the image
+        last_latency = chrono::duration<double, milli>(Clock::now() - submitted).count();
+    }
+
+    char text[32];
+    snprintf(text, sizeof(text), coarse ? "preview %.0f ms" : "%.0f ms", last_latency);
+    putText(i, text, Point(8, 24), FONT_HERSHEY_SIMPLEX, 0.7, Scalar(0, 255, 0), 2);
+    imshow("Mask", m);
+    imshow("Image", i);
+    return true;
+}
+
+void Compositor::wait() {
+    unique_lock<mutex> guard(lock);
+    flush = true; // the full resolution cut does not wait for the idle time
+    wake.notify_one();
+    done.wait(guard, [this]() { return !pending && !waiting && !busy; });
+}
@@ -0,0 +1,81 @@
+//
+// Background thread recomposing a montage for the interactive tool, the latest request wins
+//
+
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "montage.h"
+
+using namespace std;
+using namespace cv;
+
+/*
+ * The worker thread owns the montage while the compositor runs: the callbacks of the interface only submit the
+ * positions and constraints of the photos, which cancels the recomposition in progress, and the main thread presents
+ * the last completed result from its event loop. The cuts of a cancelled call which were completed are kept by
+ * Montage::recompose, so the next request only cuts the photos from the first one that changed.
+ *
+ * With a preview montage, holding the photos scaled down by factor on a canvas scaled down as well, a request is
+ * first assembled there with its positions and constraints scaled down, and its result scaled back up is presented.
+ * The full resolution cut only starts once no request has been submitted for idle ms, so dragging a photo only pays
+ * for the small cuts.
+ *
+ * A step request moves through the history of the montage, which records the requests cut at full resolution: a
+ * request which was not cut at full resolution yet is dropped first, so the first undo after an edit still in progress
+ * only drops it. The steps submitted before the worker takes them add up.
+ *
+ * The latency of a result is the time from the submit call of its request to its presentation.
+ */
+class Compositor {
+public:
+    typedef chrono::steady_clock Clock;
+
+    explicit Compositor(Montage &montage, Montage *preview = NULL, int factor = 1, int idle = 0);
+    ~Compositor();
+
+    void submit(const vector<Placement> &placements, const vector<set<pair<int,int>>> &constraints);
+    void step(int direction); // -1 to undo the last edit, 1 to redo it
+    bool stepped(vector<Placement> &placements, vector<set<pair<int,int>>> &constraints); // after the last step, once
+    bool present(); // show the last completed result if it was not shown yet, from the thread of the windows
+    void wait(); // for the last request to be cut at full resolution, the montage can be read until the next submit
+    double latency() const { return last_latency; } // of the last result presented, in ms
+
+private:
+    struct Request {
+        vector<Placement> placements;
+        vector<set<pair<int,int>>> constraints;
+        Clock::time_point submitted;
+        bool step; // through the history instead of an edit, the photos after it are given back in the request
+        int direction; // of Montage::step
+    };
+
+    Montage &montage;
+    Montage *preview;
+    int factor;
+    chrono::milliseconds idle;
+    mutex lock;
+    condition_variable wake, done;
+    Request request, deferred; // the next one, and the last one whose full resolution cut is left
+    bool pending = false, waiting = false, busy = false, stopping = false;
+    bool flush = false; // cut the deferred request without waiting, until the next submit
+    bool unsettled = false; // a request was submitted since the last one cut at full resolution
+    Request restored; // photos after the last step
+    bool restoring = false; // not given by stepped yet
+    atomic<bool> cancel;
+    Mat mask, image; // last completed result
+    Clock::time_point submitted; // of its request
+    bool fresh = false, coarse = false; // not presented yet, from the preview
+    double last_latency = 0;
+    thread worker;
+
+    void run();
+    bool compose(Montage &m, Request &r, bool scaled, Mat &m_mask, Mat &m_image); // false if it was cancelled
+};
+
+#endif //COMPOSITOR_H
@@ -0,0 +1,177 @@
+//
+// Interchangeable max-flow engines for the seam graphs of assemble
+//
+
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+#include "cut_solver.h"
+#include "push_relabel.h"
+#include "ibfs.h"
+
+unique_ptr<CutSolver> make_solver(Solver_Type type) {
+    switch (type) {
+        case Boykov_Kolmogorov:
+            return unique_ptr<CutSolver>(new BKSolver());
+        case Push_Relabel:
+            return unique_ptr<CutSolver>(new PushRelabel());
+        case Incremental_BFS:
+            return unique_ptr<CutSolver>(new IBFS());
+        default:
+            return unique_ptr<CutSolver>(new GridCutSolver());
+    }
+}
+
+unique_ptr<CutSolver> make_solver(Solver_Type type, Solver_Type reference) {
+    if (type == reference)
+        return make_solver(type);
+    return unique_ptr<CutSolver>(new CheckedSolver(make_solver(type), make_solver(reference)));
+}
+
+// The residual graph of the last cut only holds for the same n-links
+static bool same_edges(const vector<GridEdge> &a, const vector<GridEdge> &b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t k = 0; k < a.size(); k++)
+        if (a[k].i != b[k].i || a[k].j != b[k].j || a[k].cap != b[k].cap || a[k].rev_cap != b[k].rev_cap)
+            return false;
+    return true;
+}
+
+int BKSolver::solve(const GridGraph &grid, int) {
+    if (!graph || grid.node_num() > node_capacity || grid.edge_num() > edge_capacity) {
+        node_capacity = max(grid.node_num(), node_capacity + node_capacity / 2);
+        edge_capacity = max(grid.edge_num(), edge_capacity + edge_capacity / 2);
+        graph.reset(new Graph<int,int,int>(node_capacity, edge_capacity));
+    } else {
+        graph->reset();
+    }
+    grid.export_to(*graph);
+    source = grid.source;
+    sink = grid.sink;
+    edges = grid.edges;
+    graph->set_cancel(cancel);
+    int flow = graph->maxflow();
+    stale = cancelled();
+    return flow;
+}
+
+int BKSolver::update(const GridGraph &grid, int threads) {
+    if (!graph || stale || graph->get_node_num() != grid.node_num() || !same_edges(grid.edges, edges))
+        return solve(grid, threads);
+
+    // add_tweights also accepts negative weights, the flow already sent through a node is kept in the residual graph
+
+    for (int i = 0; i < grid.node_num(); i++)
+        if (grid.source[i] != source[i] || grid.sink[i] != sink[i]) {
+            graph->add_tweights(i, grid.source[i] - source[i], grid.sink[i] - sink[i]);
+            graph->mark_node(i);
+            source[i] = grid.source[i];
+            sink[i] = grid.sink[i];
+        }
+    graph->set_cancel(cancel);
+    int flow = graph->maxflow(true);
+    stale = cancelled();
+    return flow;
+}
+
+// Graph::node holds three pointers and four ints, Graph::arc three pointers and an int
+size_t BKSolver::memory() const {
+    if (!graph)
+        return 0;
+    return size_t(node_capacity) * (3 * sizeof(void *) + 4 * sizeof(int)) +
+           size_t(edge_capacity) * 2 * (3 * sizeof(void *) + sizeof(int)) +
+           (source.capacity() + sink.capacity()) * sizeof(int) + edges.capacity() * sizeof(GridEdge);
+}
+
+int CheckedSolver::solve(const GridGraph &grid, int threads) {
+    int flow = solver->solve(grid, threads);
+    return check(grid, flow, reference->solve(grid, threads));
+}
+
+int CheckedSolver::update(const GridGraph &grid, int threads) {
+    int flow = solver->update(grid, threads);
+    return check(grid, flow, reference->update(grid, threads));
+}
+
+void CheckedSolver::set_cancel(const atomic<bool> *flag) {
+    cancel = flag;
+    solver->set_cancel(flag);
+    reference->set_cancel(flag);
+}
+
+// A cancelled cut is not valid, it is not checked
+int CheckedSolver::check(const GridGraph &grid, int flow, int reference_flow) const {
+    if (cancelled())
+        return flow;
+    CV_Assert(flow == reference_flow);
+    for (int i = 0; i < grid.num_pixel; i++)
+        CV_Assert(solver->is_sink(i) == reference->is_sink(i));
+    return flow;
+}
+
+int ArcSolver::build(const GridGraph &grid) {
+    num_node = grid.node_num();
+    int num_arc = grid.edge_num() * 2;
+
+    // count the arcs of every node, then turn the counts into offsets
+
+    first.assign(num_node + 1, 0);
+    for (const GridEdge &e : grid.edges) {
+        first[e.i + 1]++;
+        first[e.j + 1]++;
+    }
+    for (int v = 0; v < num_node; v++)
+        first[v + 1] += first[v];
+
+    head.resize(num_arc);
+    r_cap.resize(num_arc);
+    sister.resize(num_arc);
+    queue.assign(first.begin(), first.end() - 1); // next free arc of every node
+    for (const GridEdge &e : grid.edges) {
+        int a = queue[e.i]++, b = queue[e.j]++;
+        head[a] = e.j;
+        head[b] = e.i;
+        r_cap[a] = e.cap;
+        r_cap[b] = e.rev_cap;
+        sister[a] = b;
+        sister[b] = a;
+    }
+
+    // terminal weights, as in Graph::add_tweights
+
+    int flow = 0;
+    tr_cap.resize(num_node);
+    for (int v = 0; v < num_node; v++) {
+        flow += min(grid.source[v], grid.sink[v]);
+        tr_cap[v] = grid.source[v] - grid.sink[v];
+    }
+    return flow;
+}
+
+size_t ArcSolver::memory() const {
+    return (first.capacity() + head.capacity() + r_cap.capacity() + sister.capacity() + tr_cap.capacity() +
+            queue.capacity()) * sizeof(int) + sink_side.capacity();
+}
+
+void ArcSolver::find_sink_side() {
+    // breadth-first search from the sink along the residual arcs, backwards
+
+    sink_side.assign(num_node, 0);
+    queue.clear();
+    for (int v = 0; v < num_node; v++)
+        if (tr_cap[v] < 0) {
+            sink_side[v] = 1;
+            queue.push_back(v);
+        }
+
+    for (size_t k = 0; k < queue.size(); k++) {
+        int v = queue[k];
+        for (int a = first[v]; a < first[v + 1]; a++) {
+            int u = head[a];
+            if (!sink_side[u] && r_cap[sister[a]] > 0) {
+                sink_side[u] = 1;
+                queue.push_back(u);
+            }
+        }
+    }
+}
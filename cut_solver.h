@@ -0,0 +1,117 @@
+//
+// Interchangeable max-flow engines for the seam graphs of assemble
+//
+
+#ifndef CUT_SOLVER_H
+#define CUT_SOLVER_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "maxflow/graph.h"
+#include "grid_graph.h"
+#include "grid_maxflow.h"
+
+using namespace std;
+
+// max-flow engine of assemble, all of them give the same cut
+enum Solver_Type {Boykov_Kolmogorov, Grid_Cut, Push_Relabel, Incremental_BFS};
+
+/*
+ * A max-flow engine solving the GridGraph of one assemble call. The sink segment is the set of nodes which can still
+ * reach the sink in the residual graph: it is the same for every maximum flow, so the engines can be swapped without
+ * changing the output.
+ *
+ * The engines poll a cancel flag in their main loop and return as soon as it is set; the cut is then not valid, and the
+ * next update starts from scratch.
+ */
+class CutSolver {
+public:
+    virtual ~CutSolver() {}
+    virtual int solve(const GridGraph &grid, int threads = 1) = 0; // value of the maximum flow
+    virtual bool is_sink(int i) const = 0; // i is a node of the last solved GridGraph
+    virtual size_t memory() const = 0; // bytes currently allocated
+
+    // Solve again the last graph after its terminal weights have been changed, the engines which cannot reuse their
+    // previous state start from scratch, and so do the others when the nodes or the edges of the graph changed
+    virtual int update(const GridGraph &grid, int threads = 1) { return solve(grid, threads); }
+
+    virtual void set_cancel(const atomic<bool> *flag) { cancel = flag; } // NULL for none
+    bool cancelled() const { return cancel && cancel->load(memory_order_relaxed); }
+
+protected:
+    const atomic<bool> *cancel = NULL;
+};
+
+unique_ptr<CutSolver> make_solver(Solver_Type type);
+unique_ptr<CutSolver> make_solver(Solver_Type type, Solver_Type reference); // cross-checked if both differ
+
+/*
+ * Graph<int,int,int> from maxflow/, updates reuse the search trees of the previous cut. The graph is cleared with
+ * Graph::reset() for the next one and only reallocated when it has more nodes or edges than any previous graph.
+ */
+class BKSolver : public CutSolver {
+    unique_ptr<Graph<int,int,int> > graph;
+    int node_capacity = 0, edge_capacity = 0; // of the current graph
+    vector<int> source, sink; // terminal weights of the graph
+    vector<GridEdge> edges; // of the graph, an update with other edges solves from scratch
+    bool stale = false; // the last maxflow was cancelled, its search trees cannot be reused
+
+public:
+    int solve(const GridGraph &grid, int threads = 1);
+    int update(const GridGraph &grid, int threads = 1);
+    bool is_sink(int i) const { return graph->what_segment(i) == Graph<int,int,int>::SINK; }
+    size_t memory() const;
+};
+
+class GridCutSolver : public CutSolver {
+    GridMaxflow graph;
+
+public:
+    int solve(const GridGraph &grid, int threads = 1) { graph.build(grid); return graph.maxflow(threads); }
+    bool is_sink(int i) const { return graph.what_segment(i) == GridMaxflow::SINK; }
+    size_t memory() const { return graph.memory(); }
+    void set_cancel(const atomic<bool> *flag) { cancel = flag; graph.set_cancel(flag); }
+};
+
+// Run two engines on every graph and stop if their flows or their cuts differ
+class CheckedSolver : public CutSolver {
+    unique_ptr<CutSolver> solver, reference;
+
+public:
+    CheckedSolver(unique_ptr<CutSolver> solver, unique_ptr<CutSolver> reference):
+            solver(move(solver)), reference(move(reference)) {}
+    int solve(const GridGraph &grid, int threads = 1);
+    int update(const GridGraph &grid, int threads = 1);
+    bool is_sink(int i) const { return solver->is_sink(i); }
+    size_t memory() const { return solver->memory() + reference->memory(); }
+    void set_cancel(const atomic<bool> *flag);
+
+private:
+    int check(const GridGraph &grid, int flow, int reference_flow) const;
+};
+
+/*
+ * Base of the engines working on an explicit residual graph: the arcs of every node are stored contiguously, each
+ * with the index of its reverse arc, and the terminal arcs are folded into tr_cap as in Graph.
+ */
+class ArcSolver : public CutSolver {
+public:
+    bool is_sink(int i) const { return sink_side[i] != 0; }
+    size_t memory() const;
+
+protected:
+    int num_node = 0;
+    vector<int> first; // the arcs of node v are [first[v], first[v + 1])
+    vector<int> head, r_cap, sister; // per arc
+    vector<int> tr_cap; // > 0: residual capacity of SOURCE->node, < 0: minus the one of node->SINK
+
+    int build(const GridGraph &grid); // returns the flow sent directly from SOURCE to SINK through the nodes
+    void find_sink_side(); // must be called once the flow is maximum
+
+private:
+    vector<unsigned char> sink_side;
+    vector<int> queue;
+};
+
+#endif //CUT_SOLVER_H
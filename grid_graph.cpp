@@ -0,0 +1,63 @@
+//
+// Seam graph of one assemble call, laid out on the grid of the new patch
+//
+
+#include "grid_graph.h"
+
+void GridGraph::reset(int r, int c) {
+    rows = r;
+    cols = c;
+    node.resize(size_t(rows) * cols);
+    row_pixel.assign(rows, 0);
+    row_seam.assign(rows, 0);
+    row_edge.assign(rows, 0);
+}
+
+void GridGraph::layout() {
+    // exclusive prefix sums of the row counts
+
+    int pixels = 0, seams = 0, num_edge = 0;
+    for (int row = 0; row < rows; row++) {
+        int p = row_pixel[row], s = row_seam[row], e = row_edge[row];
+        row_pixel[row] = pixels;
+        row_seam[row] = seams;
+        row_edge[row] = num_edge;
+        pixels += p;
+        seams += s;
+        num_edge += e;
+    }
+
+    num_pixel = pixels;
+    num_seam = seams;
+    pixel.resize(num_pixel);
+    source.assign(node_num(), 0);
+    sink.assign(node_num(), 0);
+    edges.resize(num_edge);
+}
+
+void GridGraph::index_row(int row) {
+    int index = row_pixel[row];
+    int *plane = &node[size_t(row) * cols];
+    for (int col = 0; col < cols; col++)
+        if (plane[col] >= 0) {
+            pixel[index] = make_pair(row, col);
+            plane[col] = index++;
+        }
+}
+
+void GridGraph::export_to(Graph<int,int,int> &graph) const {
+    if (node_num() == 0)
+        return;
+    graph.add_node(node_num());
+    for (int i = 0; i < node_num(); i++)
+        if (source[i] != 0 || sink[i] != 0)
+            graph.add_tweights(i, source[i], sink[i]);
+    for (const GridEdge &e : edges)
+        graph.add_edge(e.i, e.j, e.cap, e.rev_cap);
+}
+
+size_t GridGraph::memory() const {
+    return (node.capacity() + source.capacity() + sink.capacity() + row_pixel.capacity() + row_seam.capacity() +
+            row_edge.capacity()) * sizeof(int) + pixel.capacity() * sizeof(pair<int,int>) +
+           edges.capacity() * sizeof(GridEdge);
+}
@@ -0,0 +1,53 @@
+//
+// Seam graph of one assemble call, laid out on the grid of the new patch
+//
+
+#ifndef GRID_GRAPH_H
+#define GRID_GRAPH_H
+
+#include <vector>
+#include <utility>
+#include "maxflow/graph.h"
+
+using namespace std;
+
+const int infinity = 1 << 30; // terminal weight of the constrained nodes, which pins them to that terminal
+
+struct GridEdge {
+    int i, j; // end nodes
+    int cap, rev_cap; // capacities of i->j and j->i
+
+    GridEdge() {}
+    GridEdge(int i, int j, int cap, int rev_cap): i(i), j(j), cap(cap), rev_cap(rev_cap) {}
+};
+
+/*
+ * Nodes are the overlapped pixels of the patch in row-major order, followed by the seam nodes. The graph is built in
+ * two passes: the first one counts the nodes and edges of every row, layout() turns the counts into offsets and
+ * allocates every array with its exact size, then each row is filled independently, which can be done in parallel.
+ */
+class GridGraph {
+public:
+    int rows = 0, cols = 0;
+    int num_pixel = 0, num_seam = 0;
+
+    vector<int> node; // row-major plane over the patch: node index of the pixel, -1 if the pixel is not overlapped
+    vector<pair<int,int> > pixel; // (row, col) of every pixel node in the patch
+    vector<int> source, sink; // terminal weights of every node
+    vector<GridEdge> edges; // in insertion order, row by row
+
+    // per-row number of pixel nodes, seam nodes and edges, replaced by the index of the first one after layout()
+    vector<int> row_pixel, row_seam, row_edge;
+
+    void reset(int rows, int cols);
+    void layout(); // allocate the graph once every row has been counted
+    void index_row(int row); // give an index to the overlapped pixels of a row, must be called after layout()
+    void export_to(Graph<int,int,int> &graph) const; // add all nodes and edges to an empty graph
+    size_t memory() const; // bytes currently allocated
+
+    int node_num() const { return num_pixel + num_seam; }
+    int edge_num() const { return int(edges.size()); }
+    int first_seam(int row) const { return num_pixel + row_seam[row]; }
+};
+
+#endif //GRID_GRAPH_H
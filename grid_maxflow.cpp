@@ -0,0 +1,597 @@
+//
+// Boykov-Kolmogorov max-flow specialized for the 4-connected graphs of assemble
+//
+
+#include <algorithm>
+#include <climits>
+#include "grid_maxflow.h"
+
+// special values of parent
+static const int FREE = -1; // not in a search tree
+static const int TERMINAL = -2; // connected to a terminal
+static const int ORPHAN = -3;
+
+static const int INFINITE_D = INT_MAX; // infinite distance to the terminal
+
+void GridMaxflow::build(const GridGraph &grid) {
+    rows = grid.rows;
+    cols = grid.cols;
+    num_position = rows * cols;
+    int num_node = num_position + grid.num_seam;
+
+    r_cap.assign(size_t(num_node) * 4, 0);
+    tr_cap.assign(num_node, 0);
+    slots.assign(num_node, 0);
+    seam_below.resize(size_t(num_position) * 2);
+    seam_pixel.resize(size_t(grid.num_seam) * 2);
+    position.resize(grid.num_pixel);
+    parent.resize(num_node);
+    next.resize(num_node);
+    ts.resize(num_node);
+    dist.resize(num_node);
+    is_sink.resize(num_node);
+
+    for (int i = 0; i < grid.num_pixel; i++)
+        position[i] = grid.pixel[i].first * cols + grid.pixel[i].second;
+
+    // terminal weights, as in Graph::add_tweights
+
+    flow = 0;
+    for (int i = 0; i < grid.node_num(); i++) {
+        int v = i < grid.num_pixel ? position[i] : num_position + i - grid.num_pixel;
+        flow += min(grid.source[i], grid.sink[i]);
+        tr_cap[v] = grid.source[i] - grid.sink[i];
+    }
+
+    // a seam node is always added between an edge from its first pixel and an edge to its second pixel
+
+    for (const GridEdge &e : grid.edges) {
+        if (e.j >= grid.num_pixel)
+            seam_pixel[(e.j - grid.num_pixel) * 2] = position[e.i];
+        else if (e.i >= grid.num_pixel)
+            seam_pixel[(e.i - grid.num_pixel) * 2 + 1] = position[e.j];
+    }
+
+    for (const GridEdge &e : grid.edges) {
+        if (e.i < grid.num_pixel && e.j < grid.num_pixel) {
+            int u = position[e.i], v = position[e.j];
+            int d = (v - u == cols) ? DOWN : (v - u == -cols) ? UP : (v - u == 1) ? RIGHT : LEFT;
+            r_cap[u * 4 + d] += e.cap;
+            r_cap[v * 4 + (d ^ 1)] += e.rev_cap;
+            slots[u] |= 1 << d;
+            slots[v] |= 1 << (d ^ 1);
+            continue;
+        }
+
+        int k = (e.i >= grid.num_pixel ? e.i : e.j) - grid.num_pixel;
+        int s = num_position + k;
+        int first = seam_pixel[k * 2], second = seam_pixel[k * 2 + 1];
+        bool vertical = second - first == cols;
+        if (e.j >= grid.num_pixel) {
+            // first pixel -> seam
+            int d = vertical ? DOWN : RIGHT;
+            r_cap[first * 4 + d] += e.cap;
+            r_cap[s * 4] += e.rev_cap;
+            slots[first] |= 0x11 << d;
+            slots[s] |= 1;
+            seam_below[first * 2 + (d == RIGHT)] = s;
+        } else {
+            // seam -> second pixel
+            int d = vertical ? UP : LEFT;
+            r_cap[s * 4 + 1] += e.cap;
+            r_cap[second * 4 + d] += e.rev_cap;
+            slots[second] |= 0x11 << d;
+            slots[s] |= 2;
+        }
+    }
+}
+
+size_t GridMaxflow::memory() const {
+    size_t bytes = r_cap.capacity() * sizeof(int) + tr_cap.capacity() * sizeof(int) + slots.capacity() +
+                   seam_below.capacity() * sizeof(int) + seam_pixel.capacity() * sizeof(int) +
+                   position.capacity() * sizeof(int) + parent.capacity() * sizeof(int) +
+                   next.capacity() * sizeof(int) + ts.capacity() * sizeof(int) + dist.capacity() * sizeof(int) +
+                   is_sink.capacity();
+    for (const Region &r : regions)
+        bytes += sizeof(Region) + (r.orphans.capacity() + r.orphan_queue.capacity()) * sizeof(int);
+    return bytes;
+}
+
+GridMaxflow::termtype GridMaxflow::what_segment(int i, termtype default_segm) const {
+    int v = i < int(position.size()) ? position[i] : num_position + i - int(position.size());
+    if (parent[v] != FREE)
+        return is_sink[v] ? SINK : SOURCE;
+    return default_segm;
+}
+
+/***********************************************************************/
+
+// seam node in slot d of position v
+inline int GridMaxflow::seam_node(int v, int d) const {
+    switch (d) {
+        case DOWN: return seam_below[v * 2];
+        case RIGHT: return seam_below[v * 2 + 1];
+        case UP: return seam_below[(v - cols) * 2];
+        default: return seam_below[(v - 1) * 2 + 1];
+    }
+}
+
+// node the arc points to
+inline int GridMaxflow::head(int a) const {
+    int v = a >> 2, d = a & 3;
+    if (v >= num_position)
+        return seam_pixel[(v - num_position) * 2 + d];
+    if (slots[v] & (0x10 << d))
+        return seam_node(v, d);
+    switch (d) {
+        case UP: return v - cols;
+        case DOWN: return v + cols;
+        case LEFT: return v - 1;
+        default: return v + 1;
+    }
+}
+
+// reverse arc
+inline int GridMaxflow::sister(int a) const {
+    int v = a >> 2, d = a & 3;
+    if (v >= num_position) {
+        int k = v - num_position;
+        bool vertical = seam_pixel[k * 2 + 1] - seam_pixel[k * 2] == cols;
+        int u = seam_pixel[k * 2 + d];
+        return u * 4 + (d == 0 ? (vertical ? DOWN : RIGHT) : (vertical ? UP : LEFT));
+    }
+    if (slots[v] & (0x10 << d))
+        return seam_node(v, d) * 4 + (d == DOWN || d == RIGHT ? 0 : 1);
+    return head(a) * 4 + (d ^ 1);
+}
+
+inline bool GridMaxflow::inside(const Region &r, int v) const {
+    if (v < num_position)
+        return v >= r.begin && v < r.end;
+    return v >= r.seam_begin && v < r.seam_end;
+}
+
+// seam nodes are numbered in the order of their first pixel
+int GridMaxflow::first_seam(int p) const {
+    int low = 0, high = int(seam_pixel.size()) / 2;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (seam_pixel[middle * 2] < p) low = middle + 1;
+        else                            high = middle;
+    }
+    return num_position + low;
+}
+
+/*
+	Active list and orphan lists, see maxflow.inc
+*/
+
+inline void GridMaxflow::set_active(Region &r, int i) {
+    if (next[i] < 0) {
+        if (r.queue_last[1] >= 0) next[r.queue_last[1]] = i;
+        else                      r.queue_first[1] = i;
+        r.queue_last[1] = i;
+        next[i] = i;
+    }
+}
+
+inline int GridMaxflow::next_active(Region &r) {
+    int i;
+    while (true) {
+        if ((i = r.queue_first[0]) < 0) {
+            r.queue_first[0] = i = r.queue_first[1];
+            r.queue_last[0] = r.queue_last[1];
+            r.queue_first[1] = r.queue_last[1] = -1;
+            if (i < 0) return -1;
+        }
+
+        // remove it from the active list
+        if (next[i] == i) r.queue_first[0] = r.queue_last[0] = -1;
+        else              r.queue_first[0] = next[i];
+        next[i] = -1;
+
+        // a node in the list is active iff it has a parent
+        if (parent[i] != FREE) return i;
+    }
+}
+
+inline void GridMaxflow::set_orphan_front(Region &r, int i) {
+    parent[i] = ORPHAN;
+    r.orphans.push_back(i);
+}
+
+inline void GridMaxflow::set_orphan_rear(Region &r, int i) {
+    parent[i] = ORPHAN;
+    r.orphan_queue.push_back(i);
+}
+
+/***********************************************************************/
+
+inline void GridMaxflow::init_node(Region &r, int i) {
+    next[i] = -1;
+    ts[i] = r.time;
+    if (tr_cap[i] > 0) {
+        // i is connected to the source
+        is_sink[i] = 0;
+        parent[i] = TERMINAL;
+        set_active(r, i);
+        dist[i] = 1;
+    } else if (tr_cap[i] < 0) {
+        // i is connected to the sink
+        is_sink[i] = 1;
+        parent[i] = TERMINAL;
+        set_active(r, i);
+        dist[i] = 1;
+    } else
+        parent[i] = FREE;
+}
+
+void GridMaxflow::maxflow_init(Region &r) {
+    r.queue_first[0] = r.queue_last[0] = -1;
+    r.queue_first[1] = r.queue_last[1] = -1;
+    r.orphans.clear();
+    r.time = 0;
+    r.flow = 0;
+
+    for (int i = r.begin; i < r.end; i++)
+        init_node(r, i);
+    for (int i = r.seam_begin; i < r.seam_end; i++)
+        init_node(r, i);
+}
+
+void GridMaxflow::augment(Region &r, int middle_arc) {
+    int i, a, bottleneck;
+
+    // 1. Finding bottleneck capacity
+    // 1a - the source tree
+    bottleneck = r_cap[middle_arc];
+    for (i = middle_arc >> 2; ; i = head(a)) {
+        a = parent[i];
+        if (a == TERMINAL) break;
+        bottleneck = min(bottleneck, r_cap[sister(a)]);
+    }
+    bottleneck = min(bottleneck, tr_cap[i]);
+    // 1b - the sink tree
+    for (i = head(middle_arc); ; i = head(a)) {
+        a = parent[i];
+        if (a == TERMINAL) break;
+        bottleneck = min(bottleneck, r_cap[a]);
+    }
+    bottleneck = min(bottleneck, -tr_cap[i]);
+
+    // 2. Augmenting
+    // 2a - the source tree
+    r_cap[sister(middle_arc)] += bottleneck;
+    r_cap[middle_arc] -= bottleneck;
+    for (i = middle_arc >> 2; ; i = head(a)) {
+        a = parent[i];
+        if (a == TERMINAL) break;
+        int b = sister(a);
+        r_cap[a] += bottleneck;
+        r_cap[b] -= bottleneck;
+        if (!r_cap[b])
+            set_orphan_front(r, i);
+    }
+    tr_cap[i] -= bottleneck;
+    if (!tr_cap[i])
+        set_orphan_front(r, i);
+    // 2b - the sink tree
+    for (i = head(middle_arc); ; i = head(a)) {
+        a = parent[i];
+        if (a == TERMINAL) break;
+        r_cap[sister(a)] += bottleneck;
+        r_cap[a] -= bottleneck;
+        if (!r_cap[a])
+            set_orphan_front(r, i);
+    }
+    tr_cap[i] += bottleneck;
+    if (!tr_cap[i])
+        set_orphan_front(r, i);
+
+    r.flow += bottleneck;
+}
+
+void GridMaxflow::process_source_orphan(Region &r, int i) {
+    int a0_min = FREE, d_min = INFINITE_D;
+
+    // trying to find a new parent
+    for (int d = 0; d < 4; d++) {
+        if (!(slots[i] & (1 << d)))
+            continue;
+        int a0 = i * 4 + d, j = head(a0);
+        if (!inside(r, j) || !r_cap[sister(a0)])
+            continue;
+        int a = parent[j];
+        if (is_sink[j] || a == FREE)
+            continue;
+
+        // checking the origin of j
+        int k = 0;
+        while (true) {
+            if (ts[j] == r.time) {
+                k += dist[j];
+                break;
+            }
+            a = parent[j];
+            k++;
+            if (a == TERMINAL) {
+                ts[j] = r.time;
+                dist[j] = 1;
+                break;
+            }
+            if (a == ORPHAN) {
+                k = INFINITE_D;
+                break;
+            }
+            j = head(a);
+        }
+        if (k < INFINITE_D) { // j originates from the source - done
+            if (k < d_min) {
+                a0_min = a0;
+                d_min = k;
+            }
+            // set marks along the path
+            for (j = head(a0); ts[j] != r.time; j = head(parent[j])) {
+                ts[j] = r.time;
+                dist[j] = k--;
+            }
+        }
+    }
+
+    if ((parent[i] = a0_min) != FREE) {
+        ts[i] = r.time;
+        dist[i] = d_min + 1;
+        return;
+    }
+
+    // no parent is found, process neighbors
+    for (int d = 0; d < 4; d++) {
+        if (!(slots[i] & (1 << d)))
+            continue;
+        int a0 = i * 4 + d, j = head(a0);
+        if (!inside(r, j))
+            continue;
+        int a = parent[j];
+        if (is_sink[j] || a == FREE)
+            continue;
+        if (r_cap[sister(a0)])
+            set_active(r, j);
+        if (a != TERMINAL && a != ORPHAN && head(a) == i)
+            set_orphan_rear(r, j); // add j to the end of the adoption list
+    }
+}
+
+void GridMaxflow::process_sink_orphan(Region &r, int i) {
+    int a0_min = FREE, d_min = INFINITE_D;
+
+    // trying to find a new parent
+    for (int d = 0; d < 4; d++) {
+        int a0 = i * 4 + d;
+        if (!r_cap[a0])
+            continue;
+        int j = head(a0);
+        if (!inside(r, j))
+            continue;
+        int a = parent[j];
+        if (!is_sink[j] || a == FREE)
+            continue;
+
+        // checking the origin of j
+        int k = 0;
+        while (true) {
+            if (ts[j] == r.time) {
+                k += dist[j];
+                break;
+            }
+            a = parent[j];
+            k++;
+            if (a == TERMINAL) {
+                ts[j] = r.time;
+                dist[j] = 1;
+                break;
+            }
+            if (a == ORPHAN) {
+                k = INFINITE_D;
+                break;
+            }
+            j = head(a);
+        }
+        if (k < INFINITE_D) { // j originates from the sink - done
+            if (k < d_min) {
+                a0_min = a0;
+                d_min = k;
+            }
+            // set marks along the path
+            for (j = head(a0); ts[j] != r.time; j = head(parent[j])) {
+                ts[j] = r.time;
+                dist[j] = k--;
+            }
+        }
+    }
+
+    if ((parent[i] = a0_min) != FREE) {
+        ts[i] = r.time;
+        dist[i] = d_min + 1;
+        return;
+    }
+
+    // no parent is found, process neighbors
+    for (int d = 0; d < 4; d++) {
+        if (!(slots[i] & (1 << d)))
+            continue;
+        int a0 = i * 4 + d, j = head(a0);
+        if (!inside(r, j))
+            continue;
+        int a = parent[j];
+        if (!is_sink[j] || a == FREE)
+            continue;
+        if (r_cap[a0])
+            set_active(r, j);
+        if (a != TERMINAL && a != ORPHAN && head(a) == i)
+            set_orphan_rear(r, j); // add j to the end of the adoption list
+    }
+}
+
+// Orphans of an augmentation are processed from the last one, each followed by the orphans it creates
+void GridMaxflow::adopt(Region &r) {
+    while (!r.orphans.empty()) {
+        r.orphan_queue.clear();
+        r.orphan_queue.push_back(r.orphans.back());
+        r.orphans.pop_back();
+        for (size_t k = 0; k < r.orphan_queue.size(); k++) {
+            int i = r.orphan_queue[k];
+            if (is_sink[i]) process_sink_orphan(r, i);
+            else            process_source_orphan(r, i);
+        }
+    }
+}
+
+/***********************************************************************/
+
+// Push as much flow as possible without leaving the region, from the active nodes of its search trees
+void GridMaxflow::solve(Region &r) {
+    int current_node = -1;
+
+    // main loop
+    while (true) {
+        int i = current_node;
+        if (i >= 0) {
+            next[i] = -1; // remove active flag
+            if (parent[i] == FREE) i = -1;
+        }
+        if (i < 0 && (i = next_active(r)) < 0)
+            break;
+
+        int a = -1; // arc from the source tree to the sink tree
+
+        if (!is_sink[i]) {
+            // grow source tree
+            for (int d = 0; d < 4 && a < 0; d++) {
+                int arc = i * 4 + d;
+                if (!r_cap[arc])
+                    continue;
+                int j = head(arc);
+                if (!inside(r, j))
+                    continue;
+                if (parent[j] == FREE) {
+                    is_sink[j] = 0;
+                    parent[j] = sister(arc);
+                    ts[j] = ts[i];
+                    dist[j] = dist[i] + 1;
+                    set_active(r, j);
+                } else if (is_sink[j])
+                    a = arc;
+                else if (ts[j] <= ts[i] && dist[j] > dist[i]) {
+                    // heuristic - trying to make the distance from j to the source shorter
+                    parent[j] = sister(arc);
+                    ts[j] = ts[i];
+                    dist[j] = dist[i] + 1;
+                }
+            }
+        } else {
+            // grow sink tree
+            for (int d = 0; d < 4 && a < 0; d++) {
+                if (!(slots[i] & (1 << d)))
+                    continue;
+                int arc = i * 4 + d, j = head(arc);
+                if (!inside(r, j))
+                    continue;
+                int rev = sister(arc);
+                if (!r_cap[rev])
+                    continue;
+                if (parent[j] == FREE) {
+                    is_sink[j] = 1;
+                    parent[j] = rev;
+                    ts[j] = ts[i];
+                    dist[j] = dist[i] + 1;
+                    set_active(r, j);
+                } else if (!is_sink[j])
+                    a = rev;
+                else if (ts[j] <= ts[i] && dist[j] > dist[i]) {
+                    // heuristic - trying to make the distance from j to the sink shorter
+                    parent[j] = rev;
+                    ts[j] = ts[i];
+                    dist[j] = dist[i] + 1;
+                }
+            }
+        }
+
+        r.time++;
+        if ((r.time & 1023) == 0 && cancel && cancel->load(memory_order_relaxed))
+            break;
+
+        if (a >= 0) {
+            next[i] = i; // set active flag
+            current_node = i;
+            augment(r, a);
+            adopt(r);
+        } else
+            current_node = -1;
+    }
+}
+
+/*
+ * Extend region a to region b, which lies just below it. The search trees of both halves are kept: they are valid in
+ * the union, only the nodes along the boundary need to be activated to look through the arcs between the halves.
+ */
+void GridMaxflow::merge(Region &a, const Region &b) {
+    a.queue_first[0] = a.queue_last[0] = -1;
+    a.queue_first[1] = a.queue_last[1] = -1;
+    a.time = max(a.time, b.time) + 1; // above every time stamp of both halves
+    a.flow = 0;
+
+    int boundary = b.begin;
+    for (int v = max(a.begin, boundary - cols); v < min(b.end, boundary + cols); v++)
+        if (parent[v] != FREE)
+            set_active(a, v);
+    for (int v = first_seam(boundary - cols); v < a.seam_end; v++)
+        if (parent[v] != FREE)
+            set_active(a, v);
+
+    a.end = b.end;
+    a.seam_end = b.seam_end;
+}
+
+int GridMaxflow::maxflow(int threads) {
+    // split the rows into bands
+
+    int bands = max(1, min(threads, rows / min_band_rows));
+    if (int(regions.size()) < bands)
+        regions.resize(bands);
+    num_regions = bands;
+    for (int k = 0; k < bands; k++) {
+        Region &r = regions[k];
+        r.begin = int(int64_t(rows) * k / bands) * cols;
+        r.end = int(int64_t(rows) * (k + 1) / bands) * cols;
+        r.seam_begin = first_seam(r.begin);
+        r.seam_end = first_seam(r.end);
+    }
+
+    // solve the bands in parallel, then merge neighbours until the whole graph is solved
+
+    parallel_rows(bands, [&](int k) {
+        maxflow_init(regions[k]);
+        solve(regions[k]);
+    });
+    for (int k = 0; k < num_regions; k++)
+        flow += regions[k].flow;
+
+    while (num_regions > 1 && !(cancel && cancel->load(memory_order_relaxed))) {
+        int merged = 0;
+        for (int k = 0; k < num_regions; k += 2, merged++) {
+            if (merged != k)
+                swap(regions[merged], regions[k]);
+            if (k + 1 < num_regions)
+                merge(regions[merged], regions[k + 1]);
+            else
+                regions[merged].flow = 0;
+        }
+        num_regions = merged;
+
+        parallel_rows(num_regions, [&](int k) { solve(regions[k]); });
+        for (int k = 0; k < num_regions; k++)
+            flow += regions[k].flow;
+    }
+
+    return flow;
+}
@@ -0,0 +1,103 @@
+//
+// Boykov-Kolmogorov max-flow specialized for the 4-connected graphs of assemble
+//
+
+#ifndef GRID_MAXFLOW_H
+#define GRID_MAXFLOW_H
+
+#include <vector>
+#include <atomic>
+#include "grid_graph.h"
+#include "parallel.h"
+
+using namespace std;
+
+/*
+ * Same algorithm as Graph<int,int,int> (maxflow/maxflow.inc), on a graph stored implicitly: every position of the
+ * patch rectangle is a node whose four arcs (up, down, left, right) have fixed slots, and the neighbour of a slot is
+ * computed from the position instead of being stored. A seam node sits between two pixels on a grid edge; it has two
+ * slots (towards its first and second pixel) and the corresponding slots of both pixels are flagged to lead to it.
+ *
+ * An arc is identified by node * 4 + slot, so that the parent of a node in the search trees is an integer.
+ *
+ * The final cut is the set of nodes which can still reach the sink, as with Graph, so both give the same segmentation
+ * for the same GridGraph.
+ *
+ * With several threads the rows are split into bands which are solved concurrently, arcs between two bands being
+ * ignored. Neighbouring regions are then merged pairwise, keeping their search trees, and solved again from the
+ * residual graph left by their halves, until a single region covers the whole graph: the last pass finds the remaining
+ * augmenting paths, so the flow and the cut are exact.
+ */
+class GridMaxflow {
+public:
+    typedef enum {
+        SOURCE = 0,
+        SINK = 1
+    } termtype;
+
+    void build(const GridGraph &grid); // reuse the memory of a previous graph when possible
+    int maxflow(int threads = 1);
+    void set_cancel(const atomic<bool> *flag) { cancel = flag; } // maxflow returns early once it is set
+    termtype what_segment(int i, termtype default_segm = SOURCE) const; // i is a node of the GridGraph
+    size_t memory() const; // bytes currently allocated
+
+private:
+    enum { UP = 0, DOWN = 1, LEFT = 2, RIGHT = 3 };
+
+    // A band of rows searched by one thread, with the seam nodes whose first pixel lies in it
+    struct Region {
+        int begin, end; // positions [begin, end)
+        int seam_begin, seam_end; // seam nodes [seam_begin, seam_end)
+        int flow;
+
+        int queue_first[2], queue_last[2];
+        vector<int> orphans; // orphans found by augment(), processed from the last one
+        vector<int> orphan_queue; // orphans found while processing an orphan
+        int time;
+    };
+
+    static const int min_band_rows = 16; // bands are not split further than that
+
+    int rows = 0, cols = 0;
+    int num_position = 0; // rows * cols, seam nodes come after the positions
+    int flow = 0;
+
+    vector<int> r_cap; // residual capacity of every arc, 4 slots per node
+    vector<int> tr_cap; // > 0: residual capacity of SOURCE->node, < 0: minus the one of node->SINK
+    vector<unsigned char> slots; // bits 0-3: the slot has an arc, bits 4-7: the arc leads to a seam node
+    vector<int> seam_below; // 2 per position: seam node between it and the pixel below / on its right
+    vector<int> seam_pixel; // 2 per seam node: positions of the pixels above (left) and below (right)
+    vector<int> position; // position of the pixel nodes of the GridGraph
+
+    // search trees, see Graph::node
+    vector<int> parent; // arc towards the parent, or one of the codes below
+    vector<int> next; // next active node, itself for the last one, -1 if not active
+    vector<int> ts, dist;
+    vector<unsigned char> is_sink;
+
+    vector<Region> regions; // only grows, so that the orphan lists keep their memory from one call to the next
+    int num_regions = 0;
+    const atomic<bool> *cancel = NULL;
+
+    inline int head(int a) const;
+    inline int sister(int a) const;
+    inline int seam_node(int v, int d) const;
+    inline bool inside(const Region &r, int v) const;
+    int first_seam(int position) const; // first seam node whose first pixel is at or after position
+
+    inline void set_active(Region &r, int i);
+    inline int next_active(Region &r);
+    inline void set_orphan_front(Region &r, int i);
+    inline void set_orphan_rear(Region &r, int i);
+
+    inline void init_node(Region &r, int i);
+    void maxflow_init(Region &r);
+    void augment(Region &r, int middle_arc);
+    void adopt(Region &r);
+    void process_source_orphan(Region &r, int i);
+    void process_sink_orphan(Region &r, int i);
+    void solve(Region &r);
+    void merge(Region &a, const Region &b);
+};
+
+#endif //GRID_MAXFLOW_H
@@ -0,0 +1,207 @@
+//
+// Incremental breadth-first search max-flow (IBFS)
+//
+
+#include <algorithm>
+#include <climits>
+#include "ibfs.h"
+
+// special values of parent
+static const int FREE = -1; // not in a search tree
+static const int TERMINAL = -2; // connected to a terminal
+static const int ORPHAN = -3;
+
+inline int IBFS::residual(int a, int side) const {
+    return side ? r_cap[sister[a]] : r_cap[a];
+}
+
+inline bool IBFS::has_terminal(int v, int side) const {
+    return side ? tr_cap[v] < 0 : tr_cap[v] > 0;
+}
+
+int IBFS::solve(const GridGraph &grid, int) {
+    flow = build(grid);
+
+    parent.assign(num_node, FREE);
+    dist.resize(num_node);
+    current.resize(num_node);
+    is_sink.resize(num_node);
+
+    // the nodes linked to a terminal are the first level of its tree
+
+    for (int side = 0; side < 2; side++) {
+        trees[side].level = 1;
+        trees[side].front.clear();
+        trees[side].next.clear();
+    }
+    for (int v = 0; v < num_node; v++)
+        if (tr_cap[v] != 0) {
+            int side = tr_cap[v] < 0;
+            parent[v] = TERMINAL;
+            dist[v] = 1;
+            current[v] = first[v];
+            is_sink[v] = (unsigned char)side;
+            trees[side].front.push_back(v);
+        }
+
+    // once a tree cannot grow any more, no path is left between the terminals
+
+    while (!trees[0].front.empty() && !trees[1].front.empty() && !cancelled())
+        grow(trees[0].front.size() <= trees[1].front.size() ? 0 : 1);
+
+    find_sink_side();
+    return flow;
+}
+
+size_t IBFS::memory() const {
+    size_t bytes = ArcSolver::memory() + is_sink.capacity() +
+                   (parent.capacity() + dist.capacity() + current.capacity() + orphans.capacity()) * sizeof(int);
+    for (const Tree &tree : trees)
+        bytes += (tree.front.capacity() + tree.next.capacity()) * sizeof(int);
+    return bytes;
+}
+
+// Scan every node of the front of a tree, adding its free neighbours to the next level
+void IBFS::grow(int side) {
+    Tree &tree = trees[side];
+    int level = tree.level;
+
+    for (size_t k = 0; k < tree.front.size(); k++) {
+        int v = tree.front[k];
+        int a = first[v];
+        while (a < first[v + 1] && parent[v] != FREE && is_sink[v] == side && dist[v] == level) {
+            int w = head[a];
+            if (!residual(a, side)) {
+                a++;
+            } else if (parent[w] == FREE) {
+                parent[w] = sister[a];
+                dist[w] = level + 1;
+                current[w] = sister[a];
+                is_sink[w] = (unsigned char)side;
+                tree.next.push_back(w);
+                a++;
+            } else if (is_sink[w] != side) {
+                augment(side ? sister[a] : a); // the arc is tried again if it still has some capacity
+            } else {
+                a++;
+            }
+        }
+    }
+
+    tree.front.swap(tree.next);
+    tree.next.clear();
+    tree.level++;
+}
+
+void IBFS::augment(int middle_arc) {
+    int v, a, bottleneck = r_cap[middle_arc];
+
+    // find the bottleneck capacity
+
+    for (v = head[sister[middle_arc]]; parent[v] != TERMINAL; v = head[parent[v]])
+        bottleneck = min(bottleneck, r_cap[sister[parent[v]]]);
+    bottleneck = min(bottleneck, tr_cap[v]);
+    for (v = head[middle_arc]; parent[v] != TERMINAL; v = head[parent[v]])
+        bottleneck = min(bottleneck, r_cap[parent[v]]);
+    bottleneck = min(bottleneck, -tr_cap[v]);
+
+    // augment, the nodes whose parent arc gets saturated become orphans
+
+    r_cap[sister[middle_arc]] += bottleneck;
+    r_cap[middle_arc] -= bottleneck;
+
+    for (v = head[sister[middle_arc]]; parent[v] != TERMINAL; ) {
+        a = parent[v];
+        r_cap[a] += bottleneck;
+        r_cap[sister[a]] -= bottleneck;
+        if (!r_cap[sister[a]]) {
+            parent[v] = ORPHAN;
+            orphans.push_back(v);
+        }
+        v = head[a];
+    }
+    tr_cap[v] -= bottleneck;
+    if (!tr_cap[v]) {
+        parent[v] = ORPHAN;
+        orphans.push_back(v);
+    }
+
+    for (v = head[middle_arc]; parent[v] != TERMINAL; ) {
+        a = parent[v];
+        r_cap[sister[a]] += bottleneck;
+        r_cap[a] -= bottleneck;
+        if (!r_cap[a]) {
+            parent[v] = ORPHAN;
+            orphans.push_back(v);
+        }
+        v = head[a];
+    }
+    tr_cap[v] += bottleneck;
+    if (!tr_cap[v]) {
+        parent[v] = ORPHAN;
+        orphans.push_back(v);
+    }
+
+    flow += bottleneck;
+
+    for (size_t k = 0; k < orphans.size(); k++)
+        process_orphan(orphans[k]);
+    orphans.clear();
+}
+
+void IBFS::process_orphan(int v) {
+    int side = is_sink[v];
+    Tree &tree = trees[side];
+    int d = dist[v];
+
+    // look for a parent at the same distance, orphans keep their distance and can be chosen
+
+    if (d == 1 && has_terminal(v, side)) {
+        parent[v] = TERMINAL;
+        return;
+    }
+    for (int a = current[v]; a < first[v + 1]; a++) {
+        int u = head[a];
+        if (parent[u] != FREE && is_sink[u] == side && dist[u] == d - 1 && residual(sister[a], side)) {
+            parent[v] = a;
+            current[v] = a;
+            return;
+        }
+    }
+
+    // otherwise move v further from the terminal, its children become orphans
+
+    for (int a = first[v]; a < first[v + 1]; a++) {
+        int u = head[a];
+        if (parent[u] == sister[a]) {
+            parent[u] = ORPHAN;
+            orphans.push_back(u);
+        }
+    }
+
+    int best = FREE, m = INT_MAX;
+    if (has_terminal(v, side)) {
+        best = TERMINAL;
+        m = 0;
+    } else {
+        for (int a = first[v]; a < first[v + 1]; a++) {
+            int u = head[a];
+            if (parent[u] != FREE && is_sink[u] == side && dist[u] < m && residual(sister[a], side)) {
+                best = a;
+                m = dist[u];
+            }
+        }
+    }
+
+    if (best == FREE || m > tree.level) {
+        parent[v] = FREE; // the front will reach it again if it still can
+        return;
+    }
+    parent[v] = best;
+    dist[v] = m + 1;
+    current[v] = best >= 0 ? best : first[v];
+    if (dist[v] == tree.level)
+        tree.front.push_back(v);
+    else if (dist[v] == tree.level + 1)
+        tree.next.push_back(v);
+}
@@ -0,0 +1,46 @@
+//
+// Incremental breadth-first search max-flow (IBFS)
+//
+
+#ifndef IBFS_H
+#define IBFS_H
+
+#include <vector>
+#include "cut_solver.h"
+
+using namespace std;
+
+/*
+ * Like Boykov-Kolmogorov, a source tree and a sink tree are grown until they touch, but both are kept as breadth-first
+ * search trees: every node has the exact distance to its terminal along its tree, and the trees grow one whole level
+ * at a time, the smaller front first. An orphan first looks for a new parent at the same distance, otherwise it takes
+ * the nearest neighbour of its tree and its children become orphans. A node which would go beyond the front of its
+ * tree leaves it, the front will reach it again.
+ */
+class IBFS : public ArcSolver {
+public:
+    int solve(const GridGraph &grid, int threads = 1);
+    size_t memory() const;
+
+private:
+    struct Tree {
+        int level; // distance of the front, which is being scanned or will be scanned next
+        vector<int> front, next; // nodes at level and level + 1, may hold nodes which have moved since
+    };
+
+    vector<int> parent; // arc towards the parent, or FREE, TERMINAL, ORPHAN
+    vector<int> dist;
+    vector<int> current; // arcs before it have been tried when looking for a parent at the same distance
+    vector<unsigned char> is_sink;
+    vector<int> orphans;
+    Tree trees[2]; // source tree, sink tree
+    int flow = 0;
+
+    inline int residual(int a, int side) const; // capacity of a in the direction its tree grows, away from the terminal
+    inline bool has_terminal(int v, int side) const;
+    void grow(int side);
+    void augment(int middle_arc);
+    void process_orphan(int v);
+};
+
+#endif //IBFS_H
@@ -11,7 +11,8 @@ template <typename captype, typename tcaptype, typename flowtype>
 	Graph<captype, tcaptype, flowtype>::Graph(int node_num_max, int edge_num_max, void (*err_function)(char *))
 	: node_num(0),
 	  nodeptr_block(NULL),
-	  error_function(err_function)
+	  error_function(err_function),
+	  cancel(NULL)
 {
 	if (node_num_max < 16) node_num_max = 16;
 	if (edge_num_max < 16) edge_num_max = 16;
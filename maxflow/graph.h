@@ -40,6 +40,7 @@
 #define __GRAPH_H__
 
 #include <string.h>
+#include <atomic>
 #include "block.h"
 
 #include <assert.h>
@@ -107,6 +108,9 @@ public:
 	// FOR DESCRIPTION OF changed_list, SEE remove_from_changed_list().
 	flowtype maxflow(bool reuse_trees = false, Block<node_id>* changed_list = NULL);
 
+	// maxflow() returns early, without a valid cut, once *flag is set (NULL for none)
+	void set_cancel(const std::atomic<bool>* flag) { cancel = flag; }
+
 	// After the maxflow is computed, this function returns to which
 	// segment the node 'i' belongs (Graph<captype,tcaptype,flowtype>::SOURCE or Graph<captype,tcaptype,flowtype>::SINK).
 	//
@@ -310,6 +314,8 @@ private:
 	int					maxflow_iteration; // counter
 	Block<node_id>		*changed_list;
 
+	const std::atomic<bool>	*cancel;	// polled by maxflow()
+
 	/////////////////////////////////////////////////////////////////////////
 
 	node				*queue_first[2], *queue_last[2];	// list of active nodes
@@ -2,16 +2,37 @@
 // Created by czx on 08/01/16.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include <tuple>
 #include "montage.h"
 
-const int infinity = 1 << 30;
+const int pinned_source = -2, pinned_sink = -3; // overlapped pixels left out of the graph, in its node plane
+
+// Grow area to the bounding box of area and r, an empty area takes r
+static void extend(Rect &area, const Rect &r) {
+    if (r.area() > 0)
+        area = area.area() > 0 ? (area | r) : r;
+}
 
 Montage::Montage(int row, int col, int ex_row, int ex_col): extra_row(ex_row), extra_col(ex_col) {
     max_row = row + 2 * ex_row;
     max_col = col + 2 * ex_col;
-    nap = Mat(max_row, max_col, CV_8UC3);
-    mask = Mat(max_row, max_col, CV_16SC3);
-    fixed = Mat(max_row, max_col, CV_8SC1);
+    nap = TiledCanvas(max_row, max_col);
+    coverage.assign(1, (long long)max_row * max_col);
+}
+
+// Return the index of the photo owning nap[row,col], -1 if the pixel is still empty
+inline int Montage::label(int row, int col) const {
+    return nap.label(row, col);
+}
+
+// Return the index of the photo imposed on nap[row,col] by a constraint, -1 if there is none
+inline int Montage::imposed(int row, int col) const {
+    size_t pixel = size_t(row) * max_col + col;
+    return !constrained.empty() && constrained[pixel] ? owner.find(int(pixel))->second : -1;
 }
 
 inline bool Montage::is_overlapped(int row, int col) const {
@@ -19,12 +40,12 @@ inline bool Montage::is_overlapped(int row, int col) const {
         return false;
     if (col < 0 || col >= max_col)
         return false;
-    return mask.at<Vec3s>(row, col)[0] >= 0;
+    return label(row, col) >= 0;
 }
 
 inline bool Montage::is_center_photo(int row, int col, int photo_index) const {
-    int r = photos[photo_index].rows;
-    int c = photos[photo_index].cols;
+    int r = patches[photo_index].crop.height;
+    int c = patches[photo_index].crop.width;
     return (abs(row - r / 2) < r / center_size && abs(col - c / 2) < c / center_size);
 }
 
@@ -33,9 +54,9 @@ inline bool Montage::is_center_photo(pair<int,int> pixel, int photo_index) const
 }
 
 inline bool Montage::is_border_photo(int row, int col, int photo_index) const {
-    if (row == 0 || row == photos[photo_index].rows - 1)
+    if (row == 0 || row == patches[photo_index].crop.height - 1)
         return true;
-    return (col == 0 || col == photos[photo_index].cols - 1);
+    return (col == 0 || col == patches[photo_index].crop.width - 1);
 }
 
 inline bool Montage::is_border_photo(pair<int, int> pixel, int photo_index) const {
@@ -43,38 +64,632 @@ inline bool Montage::is_border_photo(pair<int, int> pixel, int photo_index) cons
 }
 
 inline bool Montage::is_border_mask(int row, int col) const {
-    if (row == 0 || row == mask.rows - 1)
+    if (row == 0 || row == max_row - 1)
         return true;
-    if (col == 0 || col == mask.cols - 1)
+    if (col == 0 || col == max_col - 1)
         return true;
-    if (mask.at<Vec3s>(row - 1, col)[0] == -1)
+    if (label(row - 1, col) == -1)
         return true;
-    if (mask.at<Vec3s>(row + 1, col)[0] == -1)
+    if (label(row + 1, col) == -1)
         return true;
-    if (mask.at<Vec3s>(row, col - 1)[0] == -1)
+    if (label(row, col - 1) == -1)
         return true;
-    return (mask.at<Vec3s>(row, col + 1)[0] == -1);
+    return (label(row, col + 1) == -1);
+}
+
+// Return photos[index] at nap[row,col], coordinates are clamped to the photo since a seam pixel is not always covered by
+// the photo on the other side of the seam
+inline const Vec3b &Montage::pixel(int index, int row, int col) const {
+    const Mat &photo = photos[index];
+    row = min(max(row - offset[index].first, 0), photo.rows - 1);
+    col = min(max(col - offset[index].second, 0), photo.cols - 1);
+    return photo.at<Vec3b>(row, col);
 }
 
-// Return the norm of photos[a][row,col] - photos[b][row,col]
-inline int Montage::norm(int index_a, int index_b, int row, int col) const {
-    int offset_row_a = offset[index_a].first;
-    int offset_col_a = offset[index_a].second;
-    int offset_row_b = offset[index_b].first;
-    int offset_col_b = offset[index_b].second;
-    int a = int(photos[index_a].at<Vec3b>(row - offset_row_a,col - offset_col_a)[0]) - int(photos[index_b].at<Vec3b>(row - offset_row_b, col - offset_col_b)[0]);
-    int b = int(photos[index_a].at<Vec3b>(row - offset_row_a,col - offset_col_a)[1]) - int(photos[index_b].at<Vec3b>(row - offset_row_b, col - offset_col_b)[1]);
-    int c = int(photos[index_a].at<Vec3b>(row - offset_row_a,col - offset_col_a)[2]) - int(photos[index_b].at<Vec3b>(row - offset_row_b, col - offset_col_b)[2]);
-    return int(sqrt(a * a + b * b + c * c));
+// Capacities of the seam node between nap[row1,col1] and its right or lower neighbour nap[row2,col2]: to both pixels
+// and to the sink. distance1 and distance2 are the distances between the new patch and the nap at both pixels.
+inline void Montage::seam_caps(int index, int row1, int col1, int row2, int col2, int distance1, int distance2,
+                               int &cap1, int &cap2, int &cap_sink) const {
+    int label1 = label(row1, col1);
+    int label2 = label(row2, col2);
+    const Vec3b &other1 = pixel(label2, row1, col1);
+    const Vec3b &other2 = pixel(label1, row2, col2);
+    cap1 = distance1 + color_norm(other2, pixel(index, row2, col2));
+    cap2 = color_norm(other1, pixel(index, row1, col1)) + distance2;
+    cap_sink = color_norm(other1, nap.color(row1, col1)) + color_norm(nap.color(row2, col2), other2);
 }
 
-// return the matching cost between nap[row1,col1] and nap[row2,col2]
-inline int Montage::cost(int index_a, int index_b, int row1, int col1, int row2, int col2) const {
-    return norm(index_a, index_b, row1, col1) + norm(index_a, index_b, row2, col2);
+/*
+ * Link the pixel node i at nap[row1,col1] to its neighbour j at nap[row2,col2]. When both pixels come from the same
+ * photo the cost is read from the cost planes, otherwise a seam node is added whose costs involve the photos on both
+ * sides of the seam.
+ */
+inline void Montage::link(GridGraph &grid, int index, int i, int j, int row1, int col1, int row2, int col2,
+                          int distance1, int distance2, int &seam, int &edge) const {
+    int cap1, cap2;
+    seam_caps(index, row1, col1, row2, col2, distance1, distance2, cap1, cap2, grid.sink[seam]);
+    grid.edges[edge++] = GridEdge(i, seam, cap1, cap1);
+    grid.edges[edge++] = GridEdge(seam, j, cap2, cap2);
+    seam++;
+}
+
+/*
+ * Fold the link between the pixel node at patch[row,col] and its pinned neighbour at patch[row2,col2] into the
+ * terminal weights of the node: the neighbour is always on the same side, so the edge between them is cut exactly when
+ * the node takes the other side. A seam node between them only has that neighbour and the sink besides the node, its
+ * best side for either side of the node is chosen here.
+ */
+inline void Montage::fold(const SeamCost &cost, int index, int row, int col, int row2, int col2, int side,
+                          int &source, int &sink) const {
+    int row_mask = row + offset[index].first, col_mask = col + offset[index].second;
+    int row2_mask = row2 + offset[index].first, col2_mask = col2 + offset[index].second;
+    bool first = row < row2 || col < col2; // the node is above or on the left of its neighbour
+    int top = min(row, row2), left = min(col, col2);
+
+    int cap, cap_pinned, cap_sink;
+    if (label(row_mask, col_mask) == label(row2_mask, col2_mask)) {
+        cap = row != row2 ? cost.down.at<int>(top, col) : cost.right.at<int>(row, left);
+        if (side)
+            sink += cap;
+        else
+            source += cap;
+        return;
+    }
+    if (first)
+        seam_caps(index, row_mask, col_mask, row2_mask, col2_mask, cost.distance.at<int>(row, col),
+                  cost.distance.at<int>(row2, col2), cap, cap_pinned, cap_sink);
+    else
+        seam_caps(index, row2_mask, col2_mask, row_mask, col_mask, cost.distance.at<int>(row2, col2),
+                  cost.distance.at<int>(row, col), cap_pinned, cap, cap_sink);
+
+    if (side) {
+        sink += min(cap, cap_sink + cap_pinned);
+    } else {
+        sink += min(cap_sink, cap + cap_pinned);
+        source += min(cap_pinned, cap_sink + cap);
+    }
+}
+
+/*
+ * Mark the overlapped pixels of a row, and when drop is set the ones a terminal weight pins to a side: they are left
+ * out of the graph and their links become terminal weights of their neighbours. In the band mode, the pixels farther
+ * than band from the border of the patch and from the border of the mask are pinned to the patch as well.
+ */
+void Montage::pin_row(GridGraph &grid, const Cut &c, int index, int row, bool keep_center, bool drop) const {
+    int row_mask = row + offset[index].first;
+    int *plane = &grid.node[size_t(row) * grid.cols];
+    for (int col = 0; col < grid.cols; col++) {
+        int col_mask = col + offset[index].second;
+        if (!is_overlapped(row_mask, col_mask)) {
+            plane[col] = -1;
+            continue;
+        }
+        int side = drop ? pin(index, row, col, keep_center) : -1;
+        if (side < 0 && drop && band > 0 && min(min(row, col), min(grid.rows - row, grid.cols - col) - 1) > band
+            && c.distance[size_t(row) * grid.cols + col] > band)
+            side = 1;
+        plane[col] = side < 0 ? 0 : side ? pinned_sink : pinned_source;
+    }
+}
+
+void Montage::count_row(GridGraph &grid, int index, int row) const {
+    int row_mask = row + offset[index].first;
+    int *plane = &grid.node[size_t(row) * grid.cols];
+    int num_pixel = 0, num_seam = 0, num_edge = 0;
+
+    for (int col = 0; col < grid.cols; col++) {
+        if (plane[col] < 0)
+            continue;
+        int col_mask = col + offset[index].second;
+        num_pixel++;
+
+        // a pair of neighbours from different photos needs a seam node and two edges
+
+        if (row + 1 < grid.rows && plane[col + grid.cols] >= 0) {
+            bool seam = label(row_mask + 1, col_mask) != label(row_mask, col_mask);
+            num_seam += seam;
+            num_edge += seam ? 2 : 1;
+        }
+        if (col + 1 < grid.cols && plane[col + 1] >= 0) {
+            bool seam = label(row_mask, col_mask + 1) != label(row_mask, col_mask);
+            num_seam += seam;
+            num_edge += seam ? 2 : 1;
+        }
+    }
+
+    grid.row_pixel[row] = num_pixel;
+    grid.row_seam[row] = num_seam;
+    grid.row_edge[row] = num_edge;
+}
+
+void Montage::fill_row(GridGraph &grid, const SeamCost &cost, int index, int row, bool keep_center) const {
+    int row_mask = row + offset[index].first;
+    const int *plane = &grid.node[size_t(row) * grid.cols];
+    const int *distance = cost.distance.ptr<int>(row);
+    int seam = grid.first_seam(row);
+    int edge = grid.row_edge[row];
+
+    for (int col = 0; col < grid.cols; col++) {
+        int i = plane[col];
+        if (i < 0)
+            continue;
+        int col_mask = col + offset[index].second;
+
+        // Add adjacent edges and seams, with the pixel under it and on its right
+
+        if (row + 1 < grid.rows && plane[col + grid.cols] >= 0) {
+            int j = plane[col + grid.cols];
+            if (label(row_mask + 1, col_mask) != label(row_mask, col_mask))
+                link(grid, index, i, j, row_mask, col_mask, row_mask + 1, col_mask,
+                     distance[col], cost.distance.at<int>(row + 1, col), seam, edge);
+            else {
+                int cap = cost.down.at<int>(row, col);
+                grid.edges[edge++] = GridEdge(i, j, cap, cap);
+            }
+        }
+        if (col + 1 < grid.cols && plane[col + 1] >= 0) {
+            int j = plane[col + 1];
+            if (label(row_mask, col_mask + 1) != label(row_mask, col_mask))
+                link(grid, index, i, j, row_mask, col_mask, row_mask, col_mask + 1,
+                     distance[col], distance[col + 1], seam, edge);
+            else {
+                int cap = cost.right.at<int>(row, col);
+                grid.edges[edge++] = GridEdge(i, j, cap, cap);
+            }
+        }
+
+        terminal(grid, index, i, row, col, keep_center);
+
+        // links to the pinned neighbours, on the four sides since the pinned pixels are not visited
+
+        const int around[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+        for (const int *d : around) {
+            int r = row + d[0], q = col + d[1];
+            if (r < 0 || r >= grid.rows || q < 0 || q >= grid.cols)
+                continue;
+            int j = grid.node[size_t(r) * grid.cols + q];
+            if (j == pinned_source || j == pinned_sink)
+                fold(cost, index, row, col, r, q, j == pinned_sink, grid.source[i], grid.sink[i]);
+        }
+    }
+}
+
+// Side the pixel patch[row,col] is pinned to by the constraints: 1 for the sink, 0 for the source, -1 if it is free
+inline int Montage::pin(int index, int row, int col, bool keep_center) const {
+    int row_mask = row + offset[index].first;
+    int col_mask = col + offset[index].second;
+
+    int fixed = imposed(row_mask, col_mask);
+    if (fixed == index)
+        return 1;
+    if (fixed != -1)
+        return 0;
+    if (is_center_photo(row, col, index) && keep_center) // the center of patch must remain
+        return 1;
+    if (is_border_mask(row_mask, col_mask))
+        return 1;
+    if (is_border_photo(row, col, index))
+        return 0;
+    return -1;
+}
+
+// Add constraints for source and sink to the pixel node i at patch[row,col]
+inline void Montage::terminal(GridGraph &grid, int index, int i, int row, int col, bool keep_center) const {
+    int side = pin(index, row, col, keep_center);
+    grid.source[i] = side == 0 ? infinity : 0;
+    grid.sink[i] = side == 1 ? infinity : 0;
+}
+
+// Chebyshev distance of every pixel of the patch to an empty pixel of the mask inside the patch, at most band + 1
+void Montage::empty_distance(int index, Cut &c) const {
+    const Rect &crop = patches[index].crop;
+    int rows = crop.height, cols = crop.width, far = band + 1;
+    c.distance.resize(size_t(rows) * cols);
+    parallel_rows(rows, [&](int row) {
+        int *d = &c.distance[size_t(row) * cols];
+        for (int col = 0; col < cols; col++)
+            d[col] = label(row + offset[index].first, col + offset[index].second) < 0 ? 0 : far;
+        distance_line(d, cols, 1);
+        for (int col = 0; col < cols; col++)
+            d[col] = d[col] <= band ? 0 : far;
+    });
+    parallel_rows(cols, [&](int col) { distance_line(&c.distance[col], rows, cols); });
+}
+
+// Pixel at depth d of the line l of a strip along a side of a rows x cols patch, the depth grows away from the side
+static inline void strip_pixel(int side, int rows, int cols, int l, int d, int &row, int &col) {
+    row = side == 0 || side == 2 ? l : side == 1 ? d : rows - 1 - d;
+    col = side == 1 || side == 3 ? l : side == 0 ? d : cols - 1 - d;
+}
+
+const int thin_strip = 3; // the strips cut by a seam path in the auto mode are at most a third of the patch deep
+const long long unreachable = numeric_limits<long long>::max();
+
+// Cost e[x][y] of the pair patch[row,col], patch[row2,col2] when they take the sides x and y, 1 for the sink
+inline void Montage::pair_cost(const SeamCost &cost, int index, int row, int col, int row2, int col2,
+                               int e[2][2]) const {
+    for (int side = 0; side < 2; side++) {
+        int source = 0, sink = 0;
+        fold(cost, index, row, col, row2, col2, side, source, sink);
+        e[0][side] = sink;
+        e[1][side] = source;
+    }
+}
+
+/*
+ * The overlap is a strip along a side of the patch when, on every line across that side, the overlapped pixels are the
+ * first ones from the side, and the patch is not overlapped everywhere. The lines may hold any number of them.
+ */
+int Montage::strip_side(int index, Cut &c) const {
+    const Rect &crop = patches[index].crop;
+    for (int side = 0; side < 4; side++) {
+        int lines = side % 2 ? crop.width : crop.height, extent = side % 2 ? crop.height : crop.width;
+        int deepest = 0, row, col;
+        bool strip = true;
+        c.width.assign(size_t(lines), 0);
+        for (int l = 0; l < lines && strip; l++) {
+            int d = 0;
+            for (; d < extent; d++) {
+                strip_pixel(side, crop.height, crop.width, l, d, row, col);
+                if (!is_overlapped(row + offset[index].first, col + offset[index].second))
+                    break;
+            }
+            c.width[l] = d;
+            deepest = max(deepest, d);
+            for (d++; d < extent && strip; d++) {
+                strip_pixel(side, crop.height, crop.width, l, d, row, col);
+                strip = !is_overlapped(row + offset[index].first, col + offset[index].second);
+            }
+        }
+        if (strip && deepest > 0 && deepest < extent && (seam_engine == Path_Seam || deepest * thin_strip <= extent))
+            return side;
+    }
+    return -1;
+}
+
+/*
+ * Minimum error boundary cut of a strip, as in image quilting: the nap keeps split[l] pixels of every line and the
+ * patch takes the others, split moving by at most one pixel from a line to the next. The cost of a path is the cost of
+ * the graph for that labeling, seams included, so it is a cut of the same graph, minimum among the ones of this shape.
+ * The pinned pixels bound the split of their line; when no path is allowed the graph is cut instead.
+ */
+bool Montage::strip_cut(int index, bool keep_center, const SeamCost &cost, Cut &c) const {
+    const Rect &crop = patches[index].crop;
+    int side = c.side, lines = int(c.width.size()), span = *max_element(c.width.begin(), c.width.end()) + 1;
+    c.path.assign(size_t(lines) * span, unreachable);
+    c.step.assign(size_t(lines) * span, 0);
+    vector<long long> along(span), across(span);
+    vector<int> cut_across(span), cut_back(span), cut_along(span);
+
+    for (int l = 0; l < lines; l++) {
+        int width = c.width[l], row, col, row2, col2, e[2][2];
+
+        // bounds of the split from the pinned pixels, and costs of the pairs along the line
+
+        int low = 0, high = width;
+        along[0] = along[1] = 0;
+        for (int d = 0; d < width; d++) {
+            strip_pixel(side, crop.height, crop.width, l, d, row, col);
+            int pinned = pin(index, row, col, keep_center);
+            if (pinned == 0)
+                low = max(low, d + 1);
+            if (pinned == 1)
+                high = min(high, d);
+            if (d == 0)
+                continue;
+            strip_pixel(side, crop.height, crop.width, l, d - 1, row2, col2);
+            pair_cost(cost, index, row2, col2, row, col, e);
+            along[d + 1] = along[d] + e[0][0]; // both pixels kept by the nap
+            cut_along[d] = e[0][1];
+        }
+
+        // costs of the pairs across the previous line, then the best path reaching every split
+
+        int shared = l > 0 ? min(width, c.width[l - 1]) : 0;
+        across[0] = 0;
+        for (int d = 0; d < shared; d++) {
+            strip_pixel(side, crop.height, crop.width, l - 1, d, row2, col2);
+            strip_pixel(side, crop.height, crop.width, l, d, row, col);
+            pair_cost(cost, index, row2, col2, row, col, e);
+            across[d + 1] = across[d] + e[0][0];
+            cut_across[d] = e[0][1]; // kept on the previous line, taken on this one
+            cut_back[d] = e[1][0];
+        }
+
+        long long *path = &c.path[size_t(l) * span];
+        signed char *step = &c.step[size_t(l) * span];
+        for (int s = low; s <= high; s++) {
+            long long own = along[max(s, 1)] + (s > 0 && s < width ? cut_along[s] : 0);
+            if (l == 0) {
+                path[s] = own;
+                continue;
+            }
+            const long long *previous = path - span;
+            for (int move = -1; move <= 1; move++) {
+                int p = s - move;
+                if (p < 0 || p >= span || previous[p] == unreachable)
+                    continue;
+                int first = min(p, s);
+                long long total = previous[p] + own + across[min(first, shared)];
+                if (p != s && first < shared)
+                    total += p > s ? cut_across[first] : cut_back[first];
+                if (total < path[s]) {
+                    path[s] = total;
+                    step[s] = (signed char)move;
+                }
+            }
+        }
+    }
+
+    // follow the best path back from the last line
+
+    const long long *last = &c.path[size_t(lines - 1) * span];
+    int s = int(min_element(last, last + span) - last);
+    if (last[s] == unreachable)
+        return false;
+    c.split.resize(size_t(lines));
+    for (int l = lines - 1; l >= 0; l--) {
+        c.split[l] = s;
+        s -= c.step[size_t(l) * span + s];
+    }
+    return true;
+}
+
+void Montage::terminal_row(GridGraph &grid, int index, int row, bool keep_center) const {
+    const int *plane = &grid.node[size_t(row) * grid.cols];
+    for (int col = 0; col < grid.cols; col++)
+        if (plane[col] >= 0)
+            terminal(grid, index, plane[col], row, col, keep_center);
+}
+
+// The graph reads the labels of the patch area and of the pixels around it, through is_border_mask
+Rect Montage::mask_area(int index) const {
+    const Rect &crop = patches[index].crop;
+    Rect area(offset[index].second - 1, offset[index].first - 1, crop.width + 2, crop.height + 2);
+    return area & Rect(0, 0, max_col, max_row);
+}
+
+void Montage::placed_photos(const Mat &mask, vector<pair<int,pair<int,int> > > &placed) const {
+    vector<bool> seen(photos.size(), false);
+    placed.clear();
+    for (int row = 0; row < mask.rows; row++) {
+        const int *l = mask.ptr<int>(row);
+        for (int col = 0; col < mask.cols; col++)
+            if (l[col] >= 0 && !seen[l[col]]) {
+                seen[l[col]] = true;
+                placed.push_back(make_pair(l[col], offset[l[col]]));
+            }
+    }
+}
+
+void Montage::set_solver(Solver_Type type, Solver_Type ref) {
+    solver = type;
+    reference = ref;
+    scratch.clear();
+    cuts.clear();
+}
+
+void Montage::set_levels(int l, int b, bool compare) {
+    levels = max(l, 1);
+    seam_band = max(b, 1);
+    gap = compare && levels > 1 ? make_shared<CutGap>() : nullptr;
+    scratch.clear();
+    cuts.clear();
+}
+
+void Montage::set_band(int width) {
+    band = width;
+    scratch.clear();
 }
 
 void Montage::add_photo(Mat photo) {
     photos.push_back(photo);
+    patches.push_back(Patch{-1, photo.size(), 0, Rect(0, 0, photo.cols, photo.rows)});
+}
+
+int Montage::add_source(shared_ptr<TransformCache> source) {
+    sources.push_back(source);
+    return int(sources.size()) - 1;
+}
+
+/*
+ * Only the transform is recorded, so the memory of the montage does not grow with the number of patches: their pixels
+ * are fetched from the cache of the source when an assemble call reads them
+ */
+void Montage::add_patch(int source, Size size, int rotation) {
+    photos.push_back(Mat());
+    patches.push_back(Patch{source, size, rotation, Rect(0, 0, size.width, size.height)});
+}
+
+void Montage::place(int index, int offset_row, int offset_col, set<pair<int,int>> *constraint) {
+    // the overlapped part of nap and photos[index_new]
+    Rect &crop = patches[index].crop;
+    if (crop.height + offset_row >= max_row || crop.width + offset_col >= max_col){
+        crop = Rect(0, 0, min(max_col - offset_col, crop.width), min(max_row - offset_row, crop.height));
+        if (!photos[index].empty())
+            photos[index] = photos[index](crop);
+    }
+
+    if (constraint != NULL)
+        impose(index, offset_row, offset_col, *constraint);
+
+    while(int(offset.size()) <= index)
+        offset.push_back(make_pair(offset_row,offset_col));
+    offset[index] = make_pair(offset_row,offset_col);
+    if (keep_cuts && int(cuts.size()) <= index)
+        cuts.resize(index + 1);
+}
+
+void Montage::impose(int index, int offset_row, int offset_col, const set<pair<int,int>> &constraint) {
+    if (!constraint.empty() && constrained.empty())
+        constrained.assign(size_t(max_row) * max_col, false);
+    for (auto p : constraint) {
+        int pixel = (p.first + offset_row) * max_col + p.second + offset_col;
+        constrained[pixel] = true;
+        owner[pixel] = index;
+    }
+}
+
+void Montage::fetch(int index) {
+    locked.push_back(mask_area(index));
+    nap.lock(locked.back());
+    if (sources.empty())
+        return;
+
+    // the new photo, and the photos whose pixels are read at the seams of its graph
+
+    vector<int> labels(1, index);
+    Rect area = mask_area(index);
+    for (int row = area.y; row < area.y + area.height; row++)
+        for (int col = area.x; col < area.x + area.width; col++) {
+            int l = label(row, col);
+            if (l >= 0 && l != labels.back())
+                labels.push_back(l);
+        }
+    sort(labels.begin(), labels.end());
+    labels.erase(unique(labels.begin(), labels.end()), labels.end());
+
+    for (int l : labels) {
+        const Patch &p = patches[l];
+        if (p.source < 0 || !photos[l].empty())
+            continue;
+        photos[l] = sources[p.source]->get(p.size, p.rotation)(p.crop);
+        resident.push_back(l);
+    }
+}
+
+void Montage::release() {
+    for (int l : resident)
+        photos[l].release();
+    resident.clear();
+    for (const Rect &area : locked)
+        nap.unlock(area);
+    locked.clear();
+}
+
+void Montage::solve_cut(int index, bool keep_center, SeamCost &cost, Cut &c, int threads) const {
+    const Mat &patch = photos[index];
+    int offset_row = offset[index].first;
+    int offset_col = offset[index].second;
+
+    // A thin strip along a side of the patch is cut by a seam path, without a graph
+
+    c.side = seam_engine != Graph_Seam ? strip_side(index, c) : -1;
+    c.strip = false;
+    if (c.side >= 0) {
+        nap.copy_colors(Rect(offset_col, offset_row, patch.cols, patch.rows), c.under);
+        cost.compute(patch, c.under);
+        c.strip = strip_cut(index, keep_center, cost, c);
+        if (c.strip) {
+            c.mask.release(); // the graph of the photo is not up to date anymore
+            return;
+        }
+    }
+
+    // The graph only depends on the mask around the patch and on the constraints, when the mask has not changed since
+    // the last call for this photo only the terminal weights need to be updated and the previous cut is reused
+
+    Rect area = mask_area(index);
+    bool reuse = keep_cuts && c.solver && c.offset == offset[index] && c.keep_center == keep_center
+                 && c.grid.rows == patch.rows && c.grid.cols == patch.cols && c.mask.size() == area.size();
+    if (reuse) {
+        Mat labels;
+        nap.copy_labels(area, labels);
+        reuse = norm(c.mask, labels, NORM_INF) == 0;
+    }
+
+    // the same labels do not give the same capacities when a photo under the patch moved since
+
+    for (size_t k = 0; reuse && k < c.placed.size(); k++)
+        reuse = offset[c.placed[k].first] == c.placed[k].second;
+    if (!c.solver && levels > 1)
+        c.solver.reset(new CoarseToFineSolver(solver, reference, levels, seam_band, gap));
+    else if (!c.solver)
+        c.solver = make_solver(solver, reference);
+    c.solver->set_cancel(cancel);
+    GridGraph &grid = c.grid;
+
+    if (reuse) {
+        parallel_rows(patch.rows, [&](int row) { terminal_row(grid, index, row, keep_center); });
+        c.solver->update(grid, threads);
+        return;
+    }
+
+    // Build the graph: one node per overlapped pixel, one per seam between two existing photos
+
+    if (c.side < 0) {
+        nap.copy_colors(Rect(offset_col, offset_row, patch.cols, patch.rows), c.under);
+        cost.compute(patch, c.under);
+    }
+
+    bool drop = band >= 0 && !keep_cuts;
+    if (drop && band > 0)
+        empty_distance(index, c);
+    grid.reset(patch.rows, patch.cols);
+    parallel_rows(patch.rows, [&](int row) { pin_row(grid, c, index, row, keep_center, drop); });
+    parallel_rows(patch.rows, [&](int row) { count_row(grid, index, row); });
+    grid.layout();
+    parallel_rows(patch.rows, [&](int row) { grid.index_row(row); });
+    parallel_rows(patch.rows, [&](int row) { fill_row(grid, cost, index, row, keep_center); });
+
+    // Compute the min-cut, pixels in the sink segment take the new patch
+
+    c.solver->solve(grid, threads);
+    if (keep_cuts) {
+        c.offset = offset[index];
+        c.keep_center = keep_center;
+        nap.copy_labels(area, c.mask);
+        placed_photos(c.mask, c.placed);
+    }
+}
+
+inline void Montage::paint(int index, int row, int col, const Vec3b &color) {
+    int l = label(row, col);
+    if (l != index && !coverage.empty()) {
+        coverage[l + 1]--;
+        coverage[index + 1]++;
+    }
+    nap.set(row, col, index, color);
+}
+
+void Montage::commit(int index, const Cut &c) {
+    const Mat &patch = photos[index];
+    int offset_row = offset[index].first;
+    int offset_col = offset[index].second;
+    Rect area(offset_col, offset_row, patch.cols, patch.rows);
+    extend(dirty, area);
+    extend(unstaged, area);
+    if (!coverage.empty() && int(coverage.size()) <= index + 1)
+        coverage.resize(size_t(index) + 2, 0);
+
+    // The pixels of a strip beyond the seam path go to the patch, before the empty pixels change
+
+    if (c.strip) {
+        strip_cuts++;
+        for (int l = 0; l < int(c.split.size()); l++)
+            for (int d = c.split[l]; d < c.width[l]; d++) {
+                int row, col;
+                strip_pixel(c.side, patch.rows, patch.cols, l, d, row, col);
+                paint(index, row + offset_row, col + offset_col, patch.at<Vec3b>(row, col));
+            }
+    }
+
+    // Get new color for all empty pixels, and for the pixels pinned to the patch which were left out of the graph
+
+    const GridGraph &grid = c.grid;
+    for (int row = 0; row < patch.rows; row++)
+        for (int col = 0; col < patch.cols; col++)
+            if (label(row + offset_row, col + offset_col) == -1
+                || (!c.strip && grid.node[row * grid.cols + col] == pinned_sink))
+                paint(index, row + offset_row, col + offset_col, patch.at<Vec3b>(row,col));
+
+    for(int i = 0; i < grid.num_pixel && !c.strip; i++){
+        if (c.solver->is_sink(i)) {
+            int row = grid.pixel[i].first;
+            int col = grid.pixel[i].second;
+            paint(index, row + offset_row, col + offset_col, patch.at<Vec3b>(row, col));
+        }
+    }
 }
 
 /*
@@ -84,218 +699,491 @@ void Montage::add_photo(Mat photo) {
  * Params:
  *      (global) photos: list of images
  *      (global) nap: old image
- *      (global) mask: matrix of indices, mask[i,j] = k only if photos[k][i,j] = existing[i,j], the default value is -1
+ *      (global) mask: matrix of indices, mask[i,j] = k only if photos[k] at [i,j] - offset[k] = existing[i,j], the
+ *          default value is -1
  *      offset_row: offset position in x
  *      offset_col: offset position in y
  *      index: index of the new patch
  *
  */
 void Montage::assemble(int index, int offset_row, int offset_col, set<pair<int,int>> *constraint) {
-    // the overlapped part of nap and photos[index_new]
-    if (photos[index].rows + offset_row >= max_row || photos[index].cols + offset_col >= max_col){
-        Rect myROI(0, 0, min(max_col - offset_col, photos[index].cols), min(max_row - offset_row, photos[index].rows));
-        photos[index] = photos[index](myROI);
+    place(index, offset_row, offset_col, constraint);
+    if (scratch.empty()) {
+        scratch.resize(1);
+        costs.resize(1);
     }
+    Cut &c = keep_cuts ? cuts[index] : scratch[0];
+    fetch(index);
+    solve_cut(index, constraint == NULL, costs[0], c, threads);
 
-    if (constraint != NULL)
-        for (auto p : *constraint)
-            fixed.at<schar>(p.first + offset_row, p.second + offset_col) = (schar)index;
+    // a cancelled cut is not valid, the nap is left as it was and the graph is built again by the next call
 
-    Mat patch = photos[index];
-    while(offset.size() <= index)
-        offset.push_back(make_pair(offset_row,offset_col));
-    offset[index] = make_pair(offset_row,offset_col);
+    if (cancelled())
+        c.mask.release();
+    else
+        commit(index, c);
+    release();
+    peak = max(peak, memory());
+}
 
-    vector<pair<int,int>> overlap;
-    map<pair<int,int>,int> map_overlap;
-    for (int row = 0; row < patch.rows; row++)
-        for (int col = 0; col < patch.cols; col++)
-            if (is_overlapped(row + offset_row, col + offset_col)) {
-                map_overlap[make_pair(row, col)] = int(overlap.size()); // store the index
-                overlap.push_back(make_pair(row, col));
-            }
+/*
+ * A placement only reads and writes the mask and the nap inside its mask_area, so two placements whose areas do not
+ * overlap can be assembled in any order. The placements of the batch which do not overlap any earlier one, assembled
+ * or not, are cut in parallel and committed in order, then removed from the batch: the nap is the same as if the whole
+ * batch had been assembled one by one.
+ */
+void Montage::assemble(vector<Placement> &batch) {
+    vector<Placement> ready, left;
+    vector<Rect> areas;
+    for (const Placement &p : batch) {
+        place(p.index, p.row, p.col, NULL);
+        Rect area = mask_area(p.index);
+        bool independent = true;
+        for (const Rect &other : areas)
+            if ((area & other).area() > 0)
+                independent = false;
+        areas.push_back(area);
+        (independent ? ready : left).push_back(p);
+    }
 
-    // Graph cut
+    int n = int(ready.size());
+    if (int(scratch.size()) < n) {
+        scratch.resize(n);
+        costs.resize(n);
+    }
+    for (const Placement &p : ready)
+        fetch(p.index);
+    int bands = n == 1 ? threads : 1; // a single cut is split into bands instead
+    parallel_rows(n, [&](int k) {
+        int index = ready[k].index;
+        solve_cut(index, true, costs[k], keep_cuts ? cuts[index] : scratch[k], bands);
+    });
+    if (cancelled()) {
+        for (const Placement &p : ready)
+            if (keep_cuts)
+                cuts[p.index].mask.release();
+        release();
+        return; // the whole batch is left
+    }
+    for (int k = 0; k < n; k++)
+        commit(ready[k].index, keep_cuts ? cuts[ready[k].index] : scratch[k]);
+    release();
 
-    int num_node = int(overlap.size()); // the number of seam does not exceed the double of number of pixels
+    batch.swap(left);
+    peak = max(peak, memory());
+}
 
-    Graph<int,int,int> graph(num_node * 3, num_node * 4 * 3); // including the source and the sink
-    if (num_node != 0)
-        graph.add_node(num_node);
+/*
+ * Assemble the placements from an empty nap, with the constraints of every photo, as reset and a call of assemble per
+ * placement would. The nap left by every photo is kept as a snapshot, which shares the tiles of the nap until a later
+ * photo writes them, and the photos before the first one whose position or constraints changed since the last call
+ * are not cut again: the nap and the constraints are set back to what they were after them. Returns the position of
+ * the first placement cut again, placements.size() if none was, or -1 if the call was cancelled: the photos assembled
+ * until then are kept for the next call. The kept cuts of the photos cut again are only solved again when solve_cut
+ * finds the same labels around them and the photos of those labels at the same offsets, which a move before them
+ * changes even when the labels stay.
+ */
+int Montage::recompose(const vector<Placement> &placements, const vector<set<pair<int,int>>> &constraints) {
+    size_t first = 0;
+    for (; first < placements.size() && first < stages.size(); first++) {
+        const Placement &p = placements[first], &q = stages[first].placement;
+        if (p.index != q.index || p.row != q.row || p.col != q.col || constraints[p.index] != stages[first].constraint)
+            break;
+    }
 
-    int seam_index = num_node;
+    // the nap set back only differs from the current one where the photos of the stages dropped and the photos
+    // assembled since the last stage wrote
 
-    for (int i = 0; i < overlap.size(); i++) {
+    for (size_t k = first; k < stages.size(); k++)
+        extend(unstaged, stages[k].area);
+    stages.erase(stages.begin() + first, stages.end());
+    extend(dirty, unstaged);
+    unstaged = Rect();
 
-        // Consider the pixel under it and on its right
+    if (first == 0) {
+        nap.reset();
+        coverage.assign(1, (long long)max_row * max_col);
+    } else {
+        nap.restore(stages[first - 1].tiles);
+        coverage = stages[first - 1].coverage;
+    }
+    constrained.clear();
+    owner.clear();
+    for (const Stage &stage : stages)
+        impose(stage.placement.index, stage.placement.row, stage.placement.col, stage.constraint);
 
-        int row = overlap[i].first;
-        int col = overlap[i].second;
+    for (size_t k = first; k < placements.size(); k++) {
+        const Placement &p = placements[k];
+        stages.push_back(Stage{p, constraints[p.index], TileSnapshot(), Rect(), vector<long long>()});
+        if (!cancelled())
+            assemble(p.index, p.row, p.col, &stages.back().constraint);
+        if (cancelled()) {
+            stages.pop_back();
+            return -1;
+        }
+        nap.snapshot(stages.back().tiles);
+        stages.back().area = unstaged;
+        stages.back().coverage = coverage;
+        unstaged = Rect();
+    }
+    record(placements, constraints);
+    return int(first);
+}
 
-        int row_mask = row + offset_row;
-        int col_mask = col + offset_col;
+void Montage::set_history(size_t bytes) {
+    history_budget = bytes;
+    edits.clear();
+    done = 0;
+    history_bytes = 0;
+    recorded = TileSnapshot();
+}
 
-        // Add adjacent edges and seams
+/*
+ * An edit only keeps the tiles of the nap written since the last version, found by their stamps, as they were before
+ * and after it: the tiles are shared with the nap and the snapshots of recompose until one of them writes them again.
+ * The edits which were undone are dropped, then the oldest ones until the tiles they hold fit in the budget.
+ */
+void Montage::record(const vector<Placement> &placements, const vector<set<pair<int,int>>> &constraints) {
+    if (history_budget == 0)
+        return;
+    Version version{placements, constraints, coverage};
+    if (recorded.stamp.empty()) {
+        nap.snapshot(recorded);
+        current = version;
+        return;
+    }
+    bool same = placements.size() == current.placements.size() && constraints == current.constraints;
+    for (size_t k = 0; same && k < placements.size(); k++) {
+        const Placement &p = placements[k], &q = current.placements[k];
+        same = p.index == q.index && p.row == q.row && p.col == q.col;
+    }
+    if (same)
+        return;
 
-        if (row + 1 < photos[index].rows && is_overlapped(row_mask + 1, col_mask)) {
-            if (mask.at<Vec3s>(row_mask + 1, col_mask)[0] != mask.at<Vec3s>(row_mask, col_mask)[0]){
-                graph.add_node(1);
-                graph.add_tweights(seam_index, 0,
-                                   cost(mask.at<Vec3s>(row_mask + 1, col_mask)[0],
-                                        mask.at<Vec3s>(row_mask, col_mask)[0], row_mask, col_mask, row_mask + 1, col_mask));
-                graph.add_edge(i, seam_index, cost(mask.at<Vec3s>(row_mask, col_mask)[0],
-                                                 index, row_mask, col_mask, row_mask + 1, col_mask),
-                               cost(mask.at<Vec3s>(row_mask, col_mask)[0], index, row_mask, col_mask, row_mask + 1, col_mask));
-                graph.add_edge(seam_index, map_overlap[make_pair(row + 1, col)], cost(mask.at<Vec3s>(row_mask + 1, col_mask)[0], index, row_mask, col_mask, row_mask + 1, col_mask),
-                               cost(mask.at<Vec3s>(row_mask + 1, col_mask)[0], index, row_mask, col_mask, row_mask + 1,col_mask));
-                seam_index++;
-            } else
-                graph.add_edge(i, map_overlap[make_pair(row + 1, col)], cost(index, mask.at<Vec3s>(row_mask + 1, col_mask)[0], row_mask, col_mask, row_mask + 1, col_mask),
-                               cost(index, mask.at<Vec3s>(row_mask + 1, col_mask)[0], row_mask, col_mask, row_mask + 1, col_mask));
-        }
+    Edit e;
+    vector<int> index;
+    nap.changed(recorded, index);
+    recorded.select(index, e.tiles[0]);
+    nap.snapshot(e.tiles[1], index);
+    e.version[0] = current;
+    e.version[1] = version;
+    e.bytes = e.tiles[0].memory() + e.tiles[1].memory();
 
-        if (col + 1 < photos[index].cols && is_overlapped(row_mask, col_mask + 1)) {
-            if (mask.at<Vec3s>(row_mask, col_mask + 1)[0] != mask.at<Vec3s>(row_mask, col_mask)[0]){
-                graph.add_node(1);
-                graph.add_tweights(seam_index, 0,
-                                   cost(mask.at<Vec3s>(row_mask, col_mask + 1)[0],
-                                        mask.at<Vec3s>(row_mask, col_mask)[0], row_mask, col_mask, row_mask, col_mask + 1));
-                graph.add_edge(i, seam_index,cost(mask.at<Vec3s>(row_mask, col_mask)[0],
-                                                  index, row_mask,col_mask, row_mask,col_mask + 1),
-                               cost(mask.at<Vec3s>(row_mask, col_mask)[0], index, row_mask, col_mask, row_mask, col_mask + 1));
-                graph.add_edge(seam_index,map_overlap[make_pair(row, col + 1)], cost(mask.at<Vec3s>(row_mask, col_mask + 1)[0],
-                                                                                     index, row_mask, col_mask, row_mask, col_mask + 1),
-                               cost(mask.at<Vec3s>(row_mask, col_mask + 1)[0], index, row_mask, col_mask, row_mask, col_mask + 1));
-                seam_index++;
-            } else
-                graph.add_edge(i, map_overlap[make_pair(row, col + 1)], cost(index, mask.at<Vec3s>(row_mask, col_mask + 1)[0], row_mask, col_mask, row_mask, col_mask + 1),
-                               cost(index, mask.at<Vec3s>(row_mask, col_mask + 1)[0], row_mask, col_mask, row_mask, col_mask + 1));
-        }
+    for (; edits.size() > done; edits.pop_back())
+        history_bytes -= edits.back().bytes;
+    history_bytes += e.bytes;
+    edits.push_back(move(e));
+    done++;
+    for (; !edits.empty() && history_bytes > history_budget; edits.pop_front(), done--)
+        history_bytes -= edits.front().bytes;
 
-        // Add constraints for source and sink
-        if (int(fixed.at<schar>(row_mask, col_mask)) == index)
-           graph.add_tweights(i,0,infinity);
-        else if (int(fixed.at<schar>(row_mask, col_mask)) != -1)
-            graph.add_tweights(i,infinity,0);
-        else if (is_center_photo(overlap[i], index) && constraint == NULL) { // the center of patch must remain
-            graph.add_tweights(i, 0, infinity);
-        } else {
-            if (is_border_mask(overlap[i].first + offset_row, overlap[i].second + offset_col)) {
-                graph.add_tweights(i, 0, infinity);
-            } else if (is_border_photo(overlap[i],index)){
-                graph.add_tweights(i, infinity, 0);
-            } else
-                graph.add_tweights(i, 0, 0);
-        }
+    nap.snapshot(recorded);
+    current = version;
+}
+
+void Montage::apply(const TileSnapshot &tiles, const Version &version) {
+    if (!tiles.index.empty())
+        nap.restore(tiles);
+    for (int t : tiles.index) {
+        extend(dirty, nap.area(t));
+        extend(unstaged, nap.area(t));
     }
-    // Compute the min-cut
+    coverage = version.coverage;
+    constrained.clear();
+    owner.clear();
+    for (const Placement &p : version.placements) {
+        impose(p.index, p.row, p.col, version.constraints[p.index]);
+        offset[p.index] = make_pair(p.row, p.col);
+    }
+    current = version;
+}
 
-    graph.maxflow();
+/*
+ * Set the nap back to the last version recorded or stepped to, which drops the photos assembled since, then -direction
+ * edits back or direction edits forward, as far as there are. Only the tiles written by the edits are set, the stages
+ * of recompose are kept: its next call cuts the photos from the first one that differs from them. The offsets of the
+ * photos are set back with the nap, so solve_cut does not reuse a kept cut across a step unless the photos under it
+ * are where they were when it was solved. Returns false if no version was recorded, otherwise the positions and the
+ * constraints of the photos in the nap.
+ */
+bool Montage::step(int direction, vector<Placement> &placements, vector<set<pair<int,int>>> &constraints) {
+    if (recorded.stamp.empty())
+        return false;
+    vector<int> index;
+    TileSnapshot back;
+    nap.changed(recorded, index);
+    recorded.select(index, back);
+    apply(back, current);
 
-    // Get new color for all overlapped pixels
+    for (; direction < 0 && done > 0; direction++) {
+        done--;
+        apply(edits[done].tiles[0], edits[done].version[0]);
+    }
+    for (; direction > 0 && done < edits.size(); direction--) {
+        apply(edits[done].tiles[1], edits[done].version[1]);
+        done++;
+    }
+    nap.snapshot(recorded);
+    placements = current.placements;
+    constraints = current.constraints;
+    return true;
+}
 
-    for (int row = 0; row < patch.rows; row++)
-        for (int col = 0; col < patch.cols; col++)
-            if (mask.at<Vec3s>(row + offset_row, col + offset_col)[0] == -1) {
-                mask.at<Vec3s>(row + offset_row, col + offset_col) = Vec3s(short(index), short(row), short(col));
-                nap.at<Vec3b>(row + offset_row, col + offset_col) = patch.at<Vec3b>(row,col);
-            }
+size_t Montage::memory() const {
+    size_t bytes = 0;
+    for (const SeamCost &cost : costs)
+        bytes += cost.memory();
+    for (const Cut &c : scratch)
+        bytes += c.grid.memory() + (c.solver ? c.solver->memory() : 0) + c.distance.capacity() * sizeof(int)
+                 + (c.width.capacity() + c.split.capacity()) * sizeof(int) + c.path.capacity() * sizeof(long long)
+                 + c.step.capacity();
+    for (const Cut &c : cuts)
+        bytes += c.grid.memory() + (c.solver ? c.solver->memory() : 0) + c.mask.total() * c.mask.elemSize()
+                 + c.under.total() * c.under.elemSize();
+    return bytes;
+}
 
-    for(int i = 0; i < overlap.size(); i++){
-        if (graph.what_segment(i) == Graph<int,int,int>::SINK) {
-            mask.at<Vec3s>(overlap[i].first + offset_row, overlap[i].second + offset_col) = Vec3s(short(index), short(overlap[i].first), short(overlap[i].second));
-            nap.at<Vec3b>(overlap[i].first + offset_row, overlap[i].second + offset_col) = Vec3b(patch.at<Vec3b>(overlap[i].first,overlap[i].second));
-        }
+/*
+ * The checkpoint only shares the tiles of the nap and the images, which are not written again in place, so the
+ * montage goes on while a thread writes it. A single checkpoint is written at a time.
+ */
+void Montage::save_checkpoint(const string &path, const string &state) {
+    wait_checkpoint();
+    shared_ptr<Checkpoint> c = make_shared<Checkpoint>();
+    c->rows = max_row;
+    c->cols = max_col;
+    c->extra_row = extra_row;
+    c->extra_col = extra_col;
+
+    // the photos added as pixels are often the same image, it is stored once
+
+    map<tuple<const uchar *, int, int>, int> images;
+    auto image = [&](const Mat &pixels) {
+        auto key = make_tuple((const uchar *)pixels.data, pixels.rows, pixels.cols);
+        auto found = images.find(key);
+        if (found != images.end())
+            return found->second;
+        c->images.push_back(pixels);
+        return images[key] = int(c->images.size()) - 1;
+    };
+    for (size_t l = 0; l < patches.size(); l++) {
+        const Patch &p = patches[l];
+        int pixels = p.source < 0 ? image(photos[l]) : -1;
+        c->photos.push_back(Checkpoint::Photo{p.source, p.size.width, p.size.height, p.rotation, p.crop, pixels});
     }
+    c->offsets = offset;
+    for (const shared_ptr<TransformCache> &source : sources)
+        c->sources.push_back(Checkpoint::Source{image(source->original()), (long long)source->capacity()});
+    c->owner.assign(owner.begin(), owner.end());
+    sort(c->owner.begin(), c->owner.end());
+    c->state = state;
+    c->mapping = loaded;
+    nap.snapshot(c->tiles);
 
+    writing = async(launch::async, [c, path]() { return write_checkpoint(path, *c); });
 }
 
-void Montage::reset() {
-    for (int row = 0; row < nap.rows; row++)
-        for (int col = 0; col < nap.cols; col++) {
-            nap.at<Vec3b>(row, col) = Vec3b(0, 0, 0);
-            mask.at<Vec3s>(row, col) = Vec3s(-1, 0, 0);
-            fixed.at<schar>(row,col) = schar(-1);
-        }
+bool Montage::wait_checkpoint() {
+    return !writing.valid() || writing.get();
 }
 
-void Montage::show() {
-    map<int,int> colors;
-    int index = 0;
-    short c;
-    Mat tmp(mask.rows, mask.cols, CV_8U);
-    for(int row = 0; row < mask.rows; row++)
-        for(int col = 0; col < mask.cols; col++) {
-            c = mask.at<Vec3s>(row, col)[0];
-            if (colors.count(c) == 0)
-                colors[c] = index++;
-        }
-    int count = int(colors.size()) - 1;
-    for (auto a: colors)
-        colors[a.first] = count--;
-    for(int row = 0; row < mask.rows; row++)
-        for(int col = 0; col < mask.cols; col++) {
-            c = mask.at<Vec3s>(row, col)[0];
-            tmp.at<uchar>(row, col) = uchar(colors[c] * 255.0 / colors.size());
-        }
+bool Montage::load_checkpoint(const string &path, string &state) {
+    Checkpoint c;
+    if (!read_checkpoint(path, c) || c.rows != max_row || c.cols != max_col || c.extra_row != extra_row
+        || c.extra_col != extra_col || c.offsets.size() > c.photos.size())
+        return false;
+    if (!nap.fits(c.tiles))
+        return false;
+    for (const Checkpoint::Photo &p : c.photos)
+        if (p.source >= int(c.sources.size()) || p.image >= int(c.images.size()) || (p.source < 0 && p.image < 0))
+            return false;
+    for (const Checkpoint::Source &s : c.sources)
+        if (s.image < 0 || s.image >= int(c.images.size()))
+            return false;
 
-    // add border
-    for (int row = 0; row < mask.rows; row++) {
-        nap.at<Vec3b>(row, extra_col - 1) = Vec3b(0, 255, 0);
-        nap.at<Vec3b>(row, nap.cols - extra_col) = Vec3b(0, 255, 0);
-        tmp.at<uchar>(row, extra_col - 1) = 255;
-        tmp.at<uchar>(row, tmp.cols - extra_col) = 255;
-    }
-    for (int col = 0; col < mask.cols; col++) {
-        nap.at<Vec3b>(extra_row - 1, col) = Vec3b(0, 255, 0);
-        nap.at<Vec3b>(nap.rows - extra_row, col) = Vec3b(0, 255, 0);
-        tmp.at<uchar>(extra_row - 1, col) = 255;
-        tmp.at<uchar>(nap.rows - extra_row, col) = 255;
+    // the crop of a photo lies within its pixels, and within the nap at its offset
+
+    for (size_t l = 0; l < c.photos.size(); l++) {
+        const Checkpoint::Photo &p = c.photos[l];
+        Size size = p.source < 0 ? c.images[p.image].size() : Size(p.width, p.height);
+        if (p.width <= 0 || p.height <= 0 || p.crop.area() <= 0
+            || (p.crop & Rect(0, 0, size.width, size.height)) != p.crop)
+            return false;
+        if (l >= c.offsets.size())
+            continue;
+        Rect placed(c.offsets[l].second, c.offsets[l].first, p.crop.width, p.crop.height);
+        if ((placed & Rect(0, 0, max_col, max_row)) != placed)
+            return false;
     }
+    for (const pair<int,int> &o : c.owner)
+        if (o.first < 0 || size_t(o.first) >= size_t(max_row) * max_col || o.second < 0
+            || o.second >= int(c.photos.size()))
+            return false;
 
-    imshow("Mask", tmp);
-    imshow("Image", nap);
+    wait_checkpoint();
+    loaded = c.mapping;
+    sources.clear();
+    for (const Checkpoint::Source &s : c.sources)
+        sources.push_back(make_shared<TransformCache>(c.images[s.image], size_t(s.budget)));
+    photos.clear();
+    patches.clear();
+    for (const Checkpoint::Photo &p : c.photos) {
+        photos.push_back(p.source < 0 ? c.images[p.image] : Mat());
+        patches.push_back(Patch{p.source, Size(p.width, p.height), p.rotation, p.crop});
+    }
+    offset = c.offsets;
+    cuts.clear();
+    if (keep_cuts)
+        cuts.resize(offset.size());
+    constrained.clear();
+    owner.clear();
+    if (!c.owner.empty())
+        constrained.assign(size_t(max_row) * max_col, false);
+    for (const pair<int,int> &o : c.owner) {
+        constrained[o.first] = true;
+        owner[o.first] = o.second;
+    }
+    nap.restore(c.tiles);
+    stages.clear();
+    set_history(history_budget);
+    coverage.clear();
+    dirty = unstaged = Rect(0, 0, max_col, max_row);
+    state = c.state;
+    return true;
 }
 
-void Montage::save_mask(string mask_name) const {
-    Rect rect(extra_col, extra_row, max_col - 2 * extra_col, max_row - 2 * extra_row);
+void Montage::reset() {
+    nap.reset();
+    constrained.clear();
+    owner.clear();
+    stages.clear();
+    coverage.assign(1, (long long)max_row * max_col);
+    dirty = Rect(0, 0, max_col, max_row);
+    unstaged = Rect();
+    set_history(history_budget);
+}
 
-    // find all existing patches
-
-    Mat tmp(mask.rows, mask.cols, CV_8U);
-    map<int,int> colors;
-    int index = 0;
-    short c;
-    for(int row = 0; row < mask.rows; row++)
-        for(int col = 0; col < mask.cols; col++) {
-            c = mask.at<Vec3s>(row, col)[0];
-            if (colors.count(c) == 0)
-                colors[c] = index++;
+/*
+ * Pixels of every label, counted by the runs of a label within the rows of the tiles, which are long in a montage
+ */
+void Montage::count_labels() const {
+    int num_label = int(photos.size()) + 1;
+    unique_ptr<atomic<long long>[]> count(new atomic<long long>[num_label]);
+    for (int l = 0; l < num_label; l++)
+        count[l] = 0;
+    nap.scan(Rect(0, 0, max_col, max_row), [&](int, int, int n, const int *labels, const Vec3b *) {
+        for (int i = 0, j; i < n; i = j) {
+            for (j = i + 1; j < n && labels[j] == labels[i]; j++);
+            count[labels[i] + 1].fetch_add(j - i, memory_order_relaxed);
         }
+    });
+    coverage.assign(size_t(num_label), 0);
+    for (int l = 0; l < num_label; l++)
+        coverage[l] = count[l];
+}
+
+// Grey level of every label, the empty pixels are the brightest and the last photo is black, among the labels present
+void Montage::grey_levels(vector<uchar> &lut) const {
+    if (coverage.empty())
+        count_labels();
+    int num_label = max(int(photos.size()) + 1, int(coverage.size()));
+    vector<int> rank(num_label, 0);
+    int count = 0;
+    for (int l = num_label - 1; l >= 0; l--)
+        if (l < int(coverage.size()) && coverage[l] > 0)
+            rank[l] = count++;
+    lut.resize(size_t(num_label));
+    for (int l = 0; l < num_label; l++)
+        lut[l] = uchar(rank[l] * 255.0 / count);
+}
 
-    // reorder colors
+void Montage::render_labels(Mat &levels, Rect area, const vector<uchar> &lut) const {
+    nap.scan(area, [&](int row, int col, int n, const int *labels, const Vec3b *) {
+        uchar *level = levels.ptr<uchar>(row) + col;
+        for (int i = 0; i < n; i++)
+            level[i] = lut[labels[i] + 1];
+    });
+}
 
-    int count = int(colors.size()) - 1;
-    for (auto a: colors)
-        colors[a.first] = count--;
+void Montage::render_labels(Mat &levels) const {
+    vector<uchar> lut;
+    grey_levels(lut);
+    levels.create(max_row, max_col, CV_8U);
+    render_labels(levels, Rect(0, 0, max_col, max_row), lut);
+}
 
-    // compute new color
+void Montage::render_border(Mat &plane, Rect area, Scalar color) const {
+    Rect lines[] = {Rect(extra_col - 1, 0, 1, max_row), Rect(max_col - extra_col, 0, 1, max_row),
+                    Rect(0, extra_row - 1, max_col, 1), Rect(0, max_row - extra_row, max_col, 1)};
+    for (const Rect &line : lines) {
+        Rect r = line & area;
+        if (r.area() > 0)
+            plane(r).setTo(color);
+    }
+}
 
-    for(int row = 0; row < mask.rows; row++)
-        for(int col = 0; col < mask.cols; col++) {
-            c = mask.at<Vec3s>(row, col)[0];
-            tmp.at<uchar>(row, col) = uchar(colors[c] * 255.0 / colors.size());
-        }
+/*
+ * The images of the view are drawn again only where the nap changed since the last call, with the border over them.
+ * The grey levels are ranked among the photos present, so the whole mask is drawn again when that set changes.
+ */
+void Montage::update_view() const {
+    Rect whole(0, 0, max_col, max_row);
+    vector<uchar> lut;
+    grey_levels(lut);
+    Rect area = view_image.empty() ? whole : dirty & whole;
+    Rect levels_area = view_levels.empty() || lut != view_lut ? whole : area;
+    view_levels.create(max_row, max_col, CV_8U);
+    view_image.create(max_row, max_col, CV_8UC3);
+
+    render_labels(view_levels, levels_area, lut);
+    nap.scan(area, [&](int row, int col, int n, const int *, const Vec3b *colors) {
+        memcpy(view_image.ptr<Vec3b>(row) + col, colors, n * sizeof(Vec3b));
+    });
+
+    // add border
+    render_border(view_levels, levels_area, Scalar(255));
+    render_border(view_image, area, Scalar(0, 255, 0));
+    view_lut.swap(lut);
+    dirty = Rect();
+}
+
+void Montage::show() {
+    update_view();
+    imshow("Mask", view_levels);
+    imshow("Image", view_image);
+}
+
+void Montage::render(Mat &tmp, Mat &image) const {
+    update_view();
+    view_levels.copyTo(tmp);
+    view_image.copyTo(image);
+}
+
+void Montage::save_mask(string mask_name) const {
+    Rect rect(extra_col, extra_row, max_col - 2 * extra_col, max_row - 2 * extra_row);
 
-    // crop the result
+    // one grey level per existing patch, then crop the result
 
-    Mat output_mask = tmp(rect);
-    imwrite(mask_name,output_mask);
+    Mat tmp;
+    render_labels(tmp);
+    imwrite(mask_name, tmp(rect));
 }
 
 void Montage::save_output(Mat &output) const {
     // do not output the extra area
-    for (int row = 0; row < output.rows; row++)
-        for (int col = 0; col < output.cols; col++)
-            output.at<Vec3b>(row, col) = nap.at<Vec3b>(row + extra_row, col + extra_col);
+    nap.scan(Rect(extra_col, extra_row, output.cols, output.rows),
+             [&](int row, int col, int n, const int *, const Vec3b *colors) {
+        memcpy(output.ptr<Vec3b>(row - extra_row) + col - extra_col, colors, n * sizeof(Vec3b));
+    });
+}
+
+void Montage::get_canvas(Mat &canvas, Mat &filled) const {
+    canvas.create(max_row, max_col, CV_8UC3);
+    filled.create(max_row, max_col, CV_8U);
+    nap.scan(Rect(0, 0, max_col, max_row), [&](int row, int col, int n, const int *labels, const Vec3b *colors) {
+        memcpy(canvas.ptr<Vec3b>(row) + col, colors, n * sizeof(Vec3b));
+        uchar *f = filled.ptr<uchar>(row) + col;
+        for (int i = 0; i < n; i++)
+            f[i] = uchar(labels[i] >= 0);
+    });
 }
@@ -6,43 +6,213 @@
 #define MONTAGE_H
 
 #include <vector>
+#include <deque>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <iostream>
 #include <opencv2/highgui/highgui.hpp>
-#include "maxflow/graph.h"
+#include <memory>
+#include <future>
+#include "grid_graph.h"
+#include "cut_solver.h"
+#include "coarse_to_fine.h"
+#include "seam_cost.h"
+#include "parallel.h"
+#include "transform_cache.h"
+#include "tiled_canvas.h"
+#include "checkpoint.h"
 
 using namespace std;
 using namespace cv;
 
+// Engine cutting the overlaps: seam paths for the strips along a side of the patch and max-flow for the others, or
+// max-flow only, or seam paths for every strip however wide
+enum Seam_Engine {Auto_Seam, Graph_Seam, Path_Seam};
+
+// A photo to assemble at a given position of the nap
+struct Placement {
+    int index, row, col;
+
+    Placement(int index, int row, int col): index(index), row(row), col(col) {}
+};
+
 class Montage {
+    // A photo given as a transform of a shared source, cropped to the nap; source is -1 for a photo added as pixels
+    struct Patch {
+        int source;
+        Size size;
+        int rotation;
+        Rect crop;
+    };
+
+    // Graph of the last assemble call of a photo, with what it has been built from
+    struct Cut {
+        pair<int,int> offset;
+        bool keep_center;
+        Mat mask; // area of the mask under the patch and around it
+        vector<pair<int,pair<int,int> > > placed; // photos of that area with their offsets, the capacities read them
+        Mat under; // colors of the nap under the patch
+        GridGraph grid;
+        unique_ptr<CutSolver> solver;
+        vector<int> distance; // to the empty pixels under the patch, in the band mode
+        bool strip = false; // cut by a seam path instead of the graph
+        int side; // of the patch the strip lies along, 0 left, 1 top, 2 right, 3 bottom
+        vector<int> width, split; // overlapped pixels of every line of the strip, and the ones the nap keeps
+        vector<long long> path; // cost of the best seam path through every split of every line
+        vector<signed char> step; // move of that path from the previous line
+    };
+
+    // Nap left by a photo of recompose, with the position and the constraints it was assembled with
+    struct Stage {
+        Placement placement;
+        set<pair<int,int> > constraint;
+        TileSnapshot tiles;
+        Rect area; // of the nap written by the photo
+        vector<long long> coverage;
+    };
+
+    // Positions and constraints of the photos with the nap they gave, as a state of the history
+    struct Version {
+        vector<Placement> placements;
+        vector<set<pair<int,int> > > constraints;
+        vector<long long> coverage;
+    };
+
+    // Change of the nap by a call of recompose, with the tiles it wrote before and after it
+    struct Edit {
+        Version version[2];
+        TileSnapshot tiles[2];
+        size_t bytes;
+    };
+
     vector<pair<int,int> > offset;
-    vector<Mat> photos;
-    Mat mask, nap, fixed;
+    vector<Mat> photos; // pixels of the photos, only held during an assemble call for the patches of a source
+    vector<Patch> patches;
+    vector<shared_ptr<TransformCache> > sources;
+    vector<int> resident; // patches of a source whose pixels are currently held
+    vector<Rect> locked; // areas of the nap whose tiles are held for the current cuts
+    TiledCanvas nap; // colors of the nap, and index of the photo owning every pixel, its pixel follows from its offset
+    vector<bool> constrained; // pixels of the nap whose photo is imposed, as a bitmap allocated by the first constraint
+    unordered_map<int,int> owner; // photo imposed on a constrained pixel, keyed by row * max_col + col
 
     int max_row = 600; // number of rows in the output
     int max_col = 1024; // number of columns in the output
     int extra_row, extra_col;
     int center_size = 8;
+    Solver_Type solver = Grid_Cut, reference = Grid_Cut;
+    int threads = 1; // bands solved concurrently by the grid engine
+    int levels = 1, seam_band = 2; // resolutions of the coarse-to-fine cuts, 1 for a single cut of the full graph
+    Seam_Engine seam_engine = Auto_Seam;
+    int strip_cuts = 0; // placements cut by a seam path
+    int band = -1; // graphs without the pinned pixels if >= 0, and without the pixels that far from the borders if > 0
+    shared_ptr<CutGap> gap; // cost of the coarse-to-fine cuts against the full resolution ones, if they are compared
+    bool keep_cuts = false; // keep the graph of every photo to solve it again when only the constraints change
+    vector<Cut> cuts; // per photo if keep_cuts is set
+    vector<Cut> scratch; // otherwise, cut of the last placement solved by every worker
+    vector<SeamCost> costs; // scratch planes of every worker, kept for the next call
+    size_t peak = 0; // highest value of memory() after an assemble call
+    vector<Stage> stages; // after every photo of the last recompose call
+    Rect unstaged; // area of the nap written since the last stage
+    mutable vector<long long> coverage; // pixels of every label + 1, empty when unknown until the next full scan
+    mutable Rect dirty; // area of the nap changed since the view was drawn
+    mutable Mat view_levels, view_image; // images of the last show or render call
+    mutable vector<uchar> view_lut; // grey level of every label + 1 in view_levels
+    size_t history_budget = 0; // bytes of the tiles held by the edits, 0 for no history
+    size_t history_bytes = 0;
+    deque<Edit> edits; // of recompose, the oldest ones are dropped beyond the budget
+    size_t done = 0; // edits applied to the nap, the next ones are redone
+    Version current; // of the last edit recorded or stepped to
+    TileSnapshot recorded; // nap of that version, empty before the first one
+    const atomic<bool> *cancel = NULL; // stops the cuts of assemble and recompose once set
+    future<bool> writing; // checkpoint written in the background
+    shared_ptr<uchar> loaded; // mapping of the checkpoint the photos added as pixels were read from
 
 private:
+    inline int label(int row, int col) const;
+    inline int imposed(int row, int col) const;
     inline bool is_overlapped(int row, int col) const;
     inline bool is_center_photo(int row, int col, int photo_index) const;
     inline bool is_center_photo(pair<int,int> pixel, int photo_index) const;
     inline bool is_border_photo(int row, int col, int photo_index) const;
     inline bool is_border_photo(pair<int, int> pixel, int photo_index) const;
     inline bool is_border_mask(int row, int col) const;
-    inline int norm(int index_a, int index_b, int row, int col) const;
-    inline int cost(int index_a, int index_b, int row1, int col1, int row2, int col2) const;
+    inline const Vec3b &pixel(int index, int row, int col) const;
+    inline void seam_caps(int index, int row1, int col1, int row2, int col2, int distance1, int distance2,
+                          int &cap1, int &cap2, int &cap_sink) const;
+    inline void fold(const SeamCost &cost, int index, int row, int col, int row2, int col2, int side,
+                     int &source, int &sink) const;
+    inline int pin(int index, int row, int col, bool keep_center) const;
+    inline void link(GridGraph &grid, int index, int i, int j, int row1, int col1, int row2, int col2,
+                     int distance1, int distance2, int &seam, int &edge) const;
+    void pin_row(GridGraph &grid, const Cut &c, int index, int row, bool keep_center, bool drop) const;
+    void count_row(GridGraph &grid, int index, int row) const; // first pass of the graph construction
+    void empty_distance(int index, Cut &c) const; // distances of the band mode
+    void fill_row(GridGraph &grid, const SeamCost &cost, int index, int row, bool keep_center) const; // second pass
+    inline void pair_cost(const SeamCost &cost, int index, int row, int col, int row2, int col2, int e[2][2]) const;
+    int strip_side(int index, Cut &c) const; // side of the patch its overlap is a strip along, -1 if there is none
+    bool strip_cut(int index, bool keep_center, const SeamCost &cost, Cut &c) const; // false if no path is allowed
+    void terminal_row(GridGraph &grid, int index, int row, bool keep_center) const; // terminal weights only
+    inline void terminal(GridGraph &grid, int index, int i, int row, int col, bool keep_center) const;
+    Rect mask_area(int index) const; // area of the mask read by the graph of a photo
+    void placed_photos(const Mat &mask, vector<pair<int,pair<int,int> > > &placed) const; // with their offsets
+    void place(int index, int row, int col, set<pair<int,int>> *constraint); // crop the photo, record its position
+    void impose(int index, int row, int col, const set<pair<int,int>> &constraint); // pixels of the photo at row, col
+    void fetch(int index); // hold the pixels of a photo, of the photos it overlaps and the tiles of the nap under it
+    void release(); // drop the pixels of the patches, they are in the cache of their source or transformed again
+    void solve_cut(int index, bool keep_center, SeamCost &cost, Cut &c, int threads) const; // only reads the nap
+    inline void paint(int index, int row, int col, const Vec3b &color); // set a pixel of the nap, in coverage too
+    void commit(int index, const Cut &c); // copy the sink segment of a solved cut to the nap
+    void count_labels() const; // coverage from a scan of the whole nap
+    void grey_levels(vector<uchar> &lut) const; // of every label + 1, from coverage
+    void render_labels(Mat &levels, Rect area, const vector<uchar> &lut) const; // levels must be allocated
+    void render_labels(Mat &levels) const; // one grey level per photo present in the mask
+    void render_border(Mat &plane, Rect area, Scalar color) const; // lines of the border within area
+    void update_view() const; // draw the area of the view changed since the last call
+    void record(const vector<Placement> &placements, const vector<set<pair<int,int>>> &constraints);
+    void apply(const TileSnapshot &tiles, const Version &version); // set the tiles and the version of an edit
 
 public:
     Montage(int row, int col, int extra_row = 0, int extra_col = 0);
+    void set_solver(Solver_Type type, Solver_Type reference);
+    void set_solver(Solver_Type type) { set_solver(type, type); }
+    void set_keep_cuts(bool keep) { keep_cuts = keep; cuts.clear(); }
+    void set_threads(int n) { threads = max(1, n); }
+    void set_levels(int levels, int band, bool compare); // cut the graphs coarse-to-fine
+    void set_seam_engine(Seam_Engine engine) { seam_engine = engine; }
+    int strip_count() const { return strip_cuts; }
+    void set_canvas_budget(size_t bytes) { nap.set_budget(bytes); } // resident tiles of the nap, 0 for no limit
+    size_t canvas_memory() const { return nap.peak_memory(); }
+    size_t canvas_locked_memory() const { return nap.peak_locked_memory(); } // tiles under the patches being cut
+    int canvas_spills() const { return nap.spilled(); }
+    void set_band(int width); // -1 for every overlapped pixel in the graphs, see band
+    void set_cancel(const atomic<bool> *flag) { cancel = flag; } // NULL for none
+    bool cancelled() const { return cancel && cancel->load(memory_order_relaxed); }
+    double cut_excess() const { return gap ? gap->excess() : 0; } // relative to the full resolution cuts
     void add_photo(Mat photo); // add a photo to queue
+    Size photo_size(int index) const { return patches[index].size; } // before it is cropped to the nap
+    Size canvas_size() const { return Size(max_col, max_row); } // with the extra area
+    int add_source(shared_ptr<TransformCache> source); // register a sample to add patches of
+    shared_ptr<TransformCache> get_source(int source) const { return sources[source]; }
+    int source_count() const { return int(sources.size()); }
+    void add_patch(int source, Size size, int rotation); // add the sample resized and rotated to queue
     void assemble(int index, int row, int col, set<pair<int,int>> *constraint = NULL); // add a new image at a specific position
+    void assemble(vector<Placement> &batch); // assemble the independent placements in parallel, leave the others
+    int recompose(const vector<Placement> &placements, const vector<set<pair<int,int>>> &constraints);
+    void set_history(size_t bytes); // keep the edits of recompose to undo them within bytes of tiles, 0 for none
+    size_t history_memory() const { return history_bytes; }
+    bool step(int direction, vector<Placement> &placements, vector<set<pair<int,int>>> &constraints); // undo, redo
     void reset();
     void show(); // show result
+    void render(Mat &mask, Mat &image) const; // copies of the images of show
     void save_mask(string mask_name) const; // save the mask after cropping
     void save_output(Mat &output) const; // export the nap to output without cropping
+    void get_canvas(Mat &canvas, Mat &filled) const; // the whole nap, and a CV_8U plane set where it is filled
+    size_t memory() const; // bytes held by the graphs, the solvers and the scratch planes
+    void save_checkpoint(const string &path, const string &state); // in the background, with a state of the caller
+    bool wait_checkpoint(); // for the last checkpoint to be written, false if it failed
+    bool load_checkpoint(const string &path, string &state); // for a montage of the same size, false if it cannot
+    size_t peak_memory() const { return peak; }
 };
 
 
@@ -0,0 +1,32 @@
+//
+// Row-parallel loops on top of cv::parallel_for_
+//
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <opencv2/core/core.hpp>
+
+/*
+ * Wrap a functor taking a row index into a ParallelLoopBody, so that callers can write
+ * parallel_rows(n, [&](int row) { ... }) instead of declaring a body class for every loop
+ */
+template <typename F>
+class RowBody : public cv::ParallelLoopBody {
+    const F &f;
+
+public:
+    RowBody(const F &f): f(f) {}
+    void operator()(const cv::Range &range) const {
+        for (int row = range.start; row < range.end; row++)
+            f(row);
+    }
+};
+
+template <typename F>
+inline void parallel_rows(int rows, const F &f) {
+    if (rows > 0)
+        cv::parallel_for_(cv::Range(0, rows), RowBody<F>(f));
+}
+
+#endif //PARALLEL_H
@@ -0,0 +1,389 @@
+//
+// Placement of the texture patches by matching them against the nap
+//
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "patch_match.h"
+#include "parallel.h"
+
+static const double min_overlap = 0.1; // fraction of the patch which must overlap the filled nap
+static const int max_candidates = 8; // rotations tried by sub-patch matching
+static const int direct_area = 16 * 16; // windows up to that size are correlated directly
+
+// Names of the precomputed planes in a bundle
+
+static string entire_prefix(Size canvas) {
+    return "entire/" + to_string(canvas.width) + "x" + to_string(canvas.height) + "/";
+}
+
+static string sub_prefix(int range, int candidate) {
+    return "sub/" + to_string(range) + "/" + to_string(candidate) + "/";
+}
+
+// The plane of a bundle if it has the expected size and type
+static bool take(const SourceBundle &bundle, const string &name, Size size, int type, Mat &out) {
+    Mat m = bundle.get(name);
+    if (m.empty() || m.size() != size || m.type() != type)
+        return false;
+    out = m;
+    return true;
+}
+
+PatchMatcher::PatchMatcher(const Mat &sample, Size canvas, double k, const SourceBundle *bundle):
+        rows(sample.rows), cols(sample.cols), canvas_size(canvas), k(k) {
+    CV_Assert(sample.type() == CV_8UC3);
+
+    // circular correlations equal the linear ones for every offset of the canvas if nothing wraps around
+
+    dft_size = Size(getOptimalDFTSize(canvas.width + cols - 1), getOptimalDFTSize(canvas.height + rows - 1));
+
+    Mat channel[3], square(rows, cols, CV_64F, Scalar(0)), ones(rows, cols, CV_64F, Scalar(1));
+    double mean[3] = {0, 0, 0}, mean_square = 0;
+    for (int c = 0; c < 3; c++)
+        channel[c].create(rows, cols, CV_64F);
+    for (int row = 0; row < rows; row++)
+        for (int col = 0; col < cols; col++) {
+            const Vec3b &p = sample.at<Vec3b>(row, col);
+            for (int c = 0; c < 3; c++) {
+                channel[c].at<double>(row, col) = p[c];
+                square.at<double>(row, col) += double(p[c]) * p[c];
+                mean[c] += p[c];
+            }
+            mean_square += square.at<double>(row, col);
+        }
+
+    // variance of the sample, summed over the channels as the costs are
+
+    double n = double(rows) * cols;
+    variance = mean_square / n;
+    for (int c = 0; c < 3; c++)
+        variance -= (mean[c] / n) * (mean[c] / n);
+    variance = max(variance, 1.0);
+
+    if (bundle) {
+        string prefix = entire_prefix(canvas);
+        int type = bundle->get(prefix + "ones_spectrum").type();
+        bool found = take(*bundle, prefix + "square_spectrum", dft_size, type, square_spectrum) &&
+                     take(*bundle, prefix + "ones_spectrum", dft_size, type, ones_spectrum);
+        for (int c = 0; c < 3; c++)
+            found = found && take(*bundle, prefix + "spectrum" + to_string(c), dft_size, type, sample_spectrum[c]);
+        if (found)
+            return;
+    }
+    for (int c = 0; c < 3; c++)
+        forward(channel[c], sample_spectrum[c]);
+    forward(square, square_spectrum);
+    forward(ones, ones_spectrum);
+}
+
+void PatchMatcher::store(SourceBundle &bundle) const {
+    string prefix = entire_prefix(canvas_size);
+    for (int c = 0; c < 3; c++)
+        bundle.add(prefix + "spectrum" + to_string(c), sample_spectrum[c]);
+    bundle.add(prefix + "square_spectrum", square_spectrum);
+    bundle.add(prefix + "ones_spectrum", ones_spectrum);
+}
+
+void PatchMatcher::forward(const Mat &plane, Mat &out) {
+    Mat padded(dft_size, CV_64F, Scalar(0));
+    plane.copyTo(padded(Rect(0, 0, plane.cols, plane.rows)));
+    dft(padded, out, 0, plane.rows);
+}
+
+bool PatchMatcher::pick(const Mat &nap, const Mat &filled, mt19937 &random, int &row, int &col) {
+    CV_Assert(nap.size() == canvas_size && filled.size() == canvas_size);
+
+    // planes of the canvas: the three channels and their squares where the nap is filled, and the filled pixels
+
+    for (Mat &plane : planes)
+        plane.create(canvas_size, CV_64F);
+    int num_filled = 0;
+    for (int r = 0; r < canvas_size.height; r++)
+        for (int c = 0; c < canvas_size.width; c++) {
+            bool f = filled.at<uchar>(r, c) != 0;
+            const Vec3b &p = nap.at<Vec3b>(r, c);
+            double square = 0;
+            for (int ch = 0; ch < 3; ch++) {
+                planes[ch].at<double>(r, c) = f ? p[ch] : 0;
+                square += f ? double(p[ch]) * p[ch] : 0;
+            }
+            planes[3].at<double>(r, c) = square;
+            planes[4].at<double>(r, c) = f;
+            num_filled += f;
+        }
+
+    // correlations with the sample, summed in the frequency domain
+
+    forward(planes[4], spectrum);
+    mulSpectrums(spectrum, square_spectrum, sum, 0, true);
+    mulSpectrums(spectrum, ones_spectrum, product, 0, true);
+    dft(product, area, DFT_INVERSE | DFT_SCALE | DFT_REAL_OUTPUT);
+    for (int c = 0; c < 3; c++) {
+        forward(planes[c], spectrum);
+        mulSpectrums(spectrum, sample_spectrum[c], product, 0, true);
+        scaleAdd(product, -2.0, sum, sum);
+    }
+    forward(planes[3], spectrum);
+    mulSpectrums(spectrum, ones_spectrum, product, 0, true);
+    scaleAdd(product, 1.0, sum, sum);
+    dft(sum, ssd, DFT_INVERSE | DFT_SCALE | DFT_REAL_OUTPUT);
+
+    // costs of the valid offsets, then draw one of them
+
+    bool full = num_filled == canvas_size.area();
+    int num_offset = canvas_size.area();
+    double best = HUGE_VAL;
+    weights.assign(num_offset, HUGE_VAL);
+    for (int r = 0; r < canvas_size.height; r++)
+        for (int c = 0; c < canvas_size.width; c++) {
+            double overlap = std::floor(area.at<double>(r, c) + 0.5);
+            double inside = double(min(rows, canvas_size.height - r)) * min(cols, canvas_size.width - c);
+            if (overlap < max(1.0, min_overlap * inside) || (!full && overlap >= inside))
+                continue;
+            double cost = max(ssd.at<double>(r, c), 0.0) / overlap;
+            weights[r * canvas_size.width + c] = cost;
+            best = min(best, cost);
+        }
+    if (best == HUGE_VAL)
+        return false;
+
+    double total = 0;
+    for (double &w : weights) {
+        w = (w == HUGE_VAL) ? 0 : std::exp(-(w - best) / (k * variance));
+        total += w;
+    }
+    double u = double(random()) / (double(random.max()) + 1) * total;
+    int chosen = 0;
+    for (; chosen < num_offset - 1; chosen++) {
+        u -= weights[chosen];
+        if (u < 0 && weights[chosen] > 0)
+            break;
+    }
+    while (weights[chosen] == 0) // rounding left u above the total
+        chosen--;
+    row = chosen / canvas_size.width;
+    col = chosen % canvas_size.width;
+    return true;
+}
+
+SubPatchMatcher::SubPatchMatcher(const Mat &sample, int range, const SourceBundle *bundle): range(range) {
+    CV_Assert(sample.type() == CV_8UC3);
+    dft_size = Size(getOptimalDFTSize(sample.cols), getOptimalDFTSize(sample.rows));
+    if (bundle && load(sample, *bundle))
+        return;
+
+    // rotations spread over [0, range), as the random placement draws them
+
+    int n = range > 0 ? min(range, max_candidates) : 1;
+    candidates.resize(n);
+    parallel_rows(n, [&](int k) {
+        Candidate &c = candidates[k];
+        if (k == 0) {
+            c.image = sample;
+        } else {
+            Point2f center(sample.cols / 2.0f, sample.rows / 2.0f);
+            warpAffine(sample, c.image, getRotationMatrix2D(center, double(k) * range / n, 1.0), sample.size());
+        }
+
+        for (Mat &plane : c.channel)
+            plane.create(sample.rows, sample.cols, CV_64F);
+        c.square.create(sample.rows, sample.cols, CV_64F);
+        for (int row = 0; row < sample.rows; row++)
+            for (int col = 0; col < sample.cols; col++) {
+                const Vec3b &p = c.image.at<Vec3b>(row, col);
+                double square = 0;
+                for (int ch = 0; ch < 3; ch++) {
+                    c.channel[ch].at<double>(row, col) = p[ch];
+                    square += double(p[ch]) * p[ch];
+                }
+                c.square.at<double>(row, col) = square;
+            }
+        integral(c.square, c.square_sum, CV_64F);
+
+        for (int ch = 0; ch < 3; ch++) {
+            Mat padded(dft_size, CV_64F, Scalar(0));
+            c.channel[ch].copyTo(padded(Rect(0, 0, sample.cols, sample.rows)));
+            dft(padded, c.spectrum[ch]);
+        }
+        Mat padded(dft_size, CV_64F, Scalar(0));
+        c.square.copyTo(padded(Rect(0, 0, sample.cols, sample.rows)));
+        dft(padded, c.square_spectrum);
+    });
+}
+
+// The candidates of a bundle, if it has every plane of every one of them for this sample size and range
+bool SubPatchMatcher::load(const Mat &sample, const SourceBundle &bundle) {
+    int n = range > 0 ? min(range, max_candidates) : 1;
+    Size size = sample.size(), sum_size(sample.cols + 1, sample.rows + 1);
+    vector<Candidate> found(n);
+    for (int k = 0; k < n; k++) {
+        Candidate &c = found[k];
+        string prefix = sub_prefix(range, k);
+        int spectrum_type = bundle.get(prefix + "square_spectrum").type();
+        bool ok = take(bundle, prefix + "image", size, CV_8UC3, c.image) &&
+                  take(bundle, prefix + "square", size, CV_64F, c.square) &&
+                  take(bundle, prefix + "square_sum", sum_size, CV_64F, c.square_sum) &&
+                  take(bundle, prefix + "square_spectrum", dft_size, spectrum_type, c.square_spectrum);
+        for (int ch = 0; ch < 3 && ok; ch++)
+            ok = take(bundle, prefix + "channel" + to_string(ch), size, CV_64F, c.channel[ch]) &&
+                 take(bundle, prefix + "spectrum" + to_string(ch), dft_size, spectrum_type, c.spectrum[ch]);
+        if (!ok)
+            return false;
+    }
+
+    // the planes are those of this sample, not of another one of the same size
+
+    for (int row = 0; row < sample.rows; row++)
+        if (memcmp(found[0].image.ptr(row), sample.ptr(row), sample.cols * sample.elemSize()) != 0)
+            return false;
+    candidates.swap(found);
+    return true;
+}
+
+void SubPatchMatcher::store(SourceBundle &bundle) const {
+    for (int k = 0; k < int(candidates.size()); k++) {
+        const Candidate &c = candidates[k];
+        string prefix = sub_prefix(range, k);
+        bundle.add(prefix + "image", c.image);
+        bundle.add(prefix + "square", c.square);
+        bundle.add(prefix + "square_sum", c.square_sum);
+        bundle.add(prefix + "square_spectrum", c.square_spectrum);
+        for (int ch = 0; ch < 3; ch++) {
+            bundle.add(prefix + "channel" + to_string(ch), c.channel[ch]);
+            bundle.add(prefix + "spectrum" + to_string(ch), c.spectrum[ch]);
+        }
+    }
+}
+
+// A window of half the sample around an empty pixel next to a filled one, anywhere once the nap is full
+Rect SubPatchMatcher::window(const Mat &filled, mt19937 &random) const {
+    int rows = max(1, candidates[0].image.rows / 2), cols = max(1, candidates[0].image.cols / 2);
+    rows = min(rows, filled.rows);
+    cols = min(cols, filled.cols);
+
+    vector<int> border;
+    for (int r = 0; r < filled.rows; r++)
+        for (int c = 0; c < filled.cols; c++) {
+            if (filled.at<uchar>(r, c))
+                continue;
+            if ((r > 0 && filled.at<uchar>(r - 1, c)) || (r + 1 < filled.rows && filled.at<uchar>(r + 1, c)) ||
+                (c > 0 && filled.at<uchar>(r, c - 1)) || (c + 1 < filled.cols && filled.at<uchar>(r, c + 1)))
+                border.push_back(r * filled.cols + c);
+        }
+
+    int center_row, center_col;
+    if (border.empty()) {
+        center_row = int(random() % filled.rows);
+        center_col = int(random() % filled.cols);
+    } else {
+        int p = border[random() % border.size()];
+        center_row = p / filled.cols;
+        center_col = p % filled.cols;
+    }
+    int row = min(max(center_row - rows / 2, 0), filled.rows - rows);
+    int col = min(max(center_col - cols / 2, 0), filled.cols - cols);
+    return Rect(col, row, cols, rows);
+}
+
+void SubPatchMatcher::correlate(const Mat &spectrum, const Mat &plane, Mat &out) const {
+    Mat padded(dft_size, CV_64F, Scalar(0)), plane_spectrum, product;
+    plane.copyTo(padded(Rect(0, 0, plane.cols, plane.rows)));
+    dft(padded, plane_spectrum, 0, plane.rows);
+    mulSpectrums(spectrum, plane_spectrum, product, 0, true);
+    dft(product, out, DFT_INVERSE | DFT_SCALE | DFT_REAL_OUTPUT);
+}
+
+/*
+ * Best translation (row, col) of the window inside the candidate, with row <= max_row and col <= max_col, returns its
+ * SSD without the |window|^2 term which is the same for every candidate
+ */
+double SubPatchMatcher::search(const Candidate &c, const Mat &window, const Mat &window_filled, bool full,
+                               int max_row, int max_col, int &row, int &col) const {
+    int rows = window.rows, cols = window.cols;
+    int num_filled = 0;
+    for (int r = 0; r < rows; r++)
+        for (int q = 0; q < cols; q++)
+            num_filled += window_filled.at<uchar>(r, q) != 0;
+
+    // the three channels of the window and its filled pixels
+
+    Mat planes[4];
+    for (Mat &plane : planes)
+        plane.create(rows, cols, CV_64F);
+    for (int r = 0; r < rows; r++)
+        for (int q = 0; q < cols; q++) {
+            bool f = window_filled.at<uchar>(r, q) != 0;
+            const Vec3b &p = window.at<Vec3b>(r, q);
+            for (int ch = 0; ch < 3; ch++)
+                planes[ch].at<double>(r, q) = f ? p[ch] : 0;
+            planes[3].at<double>(r, q) = f;
+        }
+
+    bool direct = rows * cols <= direct_area;
+    Mat cross[3], square;
+    if (!direct) {
+        for (int ch = 0; ch < 3; ch++)
+            correlate(c.spectrum[ch], planes[ch], cross[ch]);
+        if (!full)
+            correlate(c.square_spectrum, planes[3], square);
+    }
+
+    double best = HUGE_VAL;
+    for (int y = 0; y <= max_row; y++)
+        for (int x = 0; x <= max_col; x++) {
+            double cost = 0;
+            if (direct) {
+                for (int r = 0; r < rows; r++)
+                    for (int q = 0; q < cols; q++)
+                        if (planes[3].at<double>(r, q) != 0) {
+                            cost += c.square.at<double>(y + r, x + q);
+                            for (int ch = 0; ch < 3; ch++)
+                                cost -= 2 * planes[ch].at<double>(r, q) * c.channel[ch].at<double>(y + r, x + q);
+                        }
+            } else {
+                if (full)
+                    cost = c.square_sum.at<double>(y + rows, x + cols) - c.square_sum.at<double>(y, x + cols) -
+                           c.square_sum.at<double>(y + rows, x) + c.square_sum.at<double>(y, x);
+                else
+                    cost = square.at<double>(y, x);
+                for (int ch = 0; ch < 3; ch++)
+                    cost -= 2 * cross[ch].at<double>(y, x);
+            }
+            if (cost < best) {
+                best = cost;
+                row = y;
+                col = x;
+            }
+        }
+    return num_filled > 0 ? best : 0;
+}
+
+bool SubPatchMatcher::pick(const Mat &nap, const Mat &filled, mt19937 &random, int &candidate, int &row,
+                           int &col) const {
+    Rect area = window(filled, random);
+    const Mat &sample = candidates[0].image;
+
+    // the sample must contain the window, and is placed at a non-negative offset of the nap
+
+    int max_row = min(sample.rows - area.height, area.y);
+    int max_col = min(sample.cols - area.width, area.x);
+    if (max_row < 0 || max_col < 0)
+        return false;
+    bool full = countNonZero(filled(area)) == area.area();
+
+    int n = int(candidates.size());
+    vector<double> cost(n);
+    vector<pair<int,int> > best(n);
+    parallel_rows(n, [&](int k) {
+        cost[k] = search(candidates[k], nap(area), filled(area), full, max_row, max_col, best[k].first,
+                         best[k].second);
+    });
+
+    candidate = int(min_element(cost.begin(), cost.end()) - cost.begin());
+    row = area.y - best[candidate].first;
+    col = area.x - best[candidate].second;
+    return true;
+}
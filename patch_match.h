@@ -0,0 +1,88 @@
+//
+// Placement of the texture patches by matching them against the nap
+//
+
+#ifndef PATCH_MATCH_H
+#define PATCH_MATCH_H
+
+#include <random>
+#include <opencv2/core/core.hpp>
+#include "source_bundle.h"
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Entire patch matching of Kwatra et al.: the cost of an offset is the sum of squared differences between the sample
+ * and the filled part of the nap under it, divided by the area of that overlap, and offsets are drawn with a
+ * probability proportional to exp(-cost / (k * variance of the sample)).
+ *
+ * The costs of every offset are correlations of the nap with the sample, they are all computed at once in the
+ * frequency domain: SSD = corr(filled, sample^2) - 2 * corr(nap, sample) + corr(nap^2, 1), where the nap is set to 0
+ * where it is not filled. The spectra of the sample are computed once, each call only transforms the nap.
+ *
+ * Only offsets whose overlap covers at least a tenth of the patch are drawn, and while the nap is not full they
+ * must also cover some empty pixels, so that the texture keeps growing.
+ *
+ * The spectra of the sample are taken from a bundle holding them for this canvas size, and stored into one by store.
+ */
+class PatchMatcher {
+public:
+    PatchMatcher(const Mat &sample, Size canvas, double k = 0.1, const SourceBundle *bundle = NULL);
+    bool pick(const Mat &nap, const Mat &filled, mt19937 &random, int &row, int &col); // false if no offset fits
+    void store(SourceBundle &bundle) const;
+
+private:
+    int rows, cols; // of the sample
+    Size canvas_size, dft_size;
+    double k, variance;
+
+    Mat sample_spectrum[3], square_spectrum, ones_spectrum;
+    Mat planes[5], spectrum, product, sum, ssd, area; // scratch
+    vector<double> weights;
+
+    void forward(const Mat &plane, Mat &out); // spectrum of a plane padded to dft_size
+};
+
+/*
+ * Sub-patch matching of Kwatra et al.: a window of the nap which needs filling is chosen, on the border of the filled
+ * area or anywhere once the nap is full, then the translation of the sample matching its filled pixels best is
+ * searched, and the whole sample is placed so that this part of it lands on the window.
+ *
+ * With a rotation range, the sample is also rotated by a few angles spread over it and every candidate is searched in
+ * parallel. The cost of a translation t is
+ *      SSD(t) = corr(sample^2, filled)(t) - 2 * corr(sample, window)(t) + |window|^2
+ * where the window is set to 0 where it is not filled. The first term is a box sum of a summed-area table when the
+ * whole window is filled, a correlation otherwise; the correlations are done in the frequency domain with the spectra
+ * of the candidates computed once, unless the window is small enough for a direct sum.
+ *
+ * The candidates and their planes are taken from a bundle holding them for this range, and stored into one by store.
+ */
+class SubPatchMatcher {
+public:
+    SubPatchMatcher(const Mat &sample, int range, const SourceBundle *bundle = NULL);
+    bool pick(const Mat &nap, const Mat &filled, mt19937 &random, int &candidate, int &row, int &col) const;
+    const Mat &sample(int candidate) const { return candidates[candidate].image; }
+    void store(SourceBundle &bundle) const;
+
+private:
+    struct Candidate {
+        Mat image;
+        Mat channel[3], square; // CV_64F
+        Mat square_sum; // summed-area table of square
+        Mat spectrum[3], square_spectrum;
+    };
+
+    Size dft_size;
+    int range;
+    vector<Candidate> candidates;
+
+    bool load(const Mat &sample, const SourceBundle &bundle);
+
+    Rect window(const Mat &filled, mt19937 &random) const;
+    void correlate(const Mat &spectrum, const Mat &plane, Mat &out) const; // corr(candidate, plane) from its spectrum
+    double search(const Candidate &c, const Mat &window, const Mat &window_filled, bool full, int max_row,
+                  int max_col, int &row, int &col) const;
+};
+
+#endif //PATCH_MATCH_H
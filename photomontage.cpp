@@ -5,13 +5,26 @@
  * see the result.
  *
  * Parameters:
- *      i: number of input images and their name
+ *      i: number of input images and their name, a bundle made by the bundle tool gives all its images
  *      o: path to the output image
  *      h: height of output image
  *      w: width of output image
+ *      j: number of threads (1 by default)
+ *      g: max-flow engine (0 for Boykov-Kolmogorov by default, 1 for the grid engine, 2 for push-relabel, 3 for IBFS),
+ *         only Boykov-Kolmogorov reuses the previous cut of a photo when its constraints are edited
+ *      c: engine checking every cut of the first one, in the same encoding (none by default)
+ *      l: number of resolutions of the coarse-to-fine cuts (1 by default, for a single cut at full resolution)
+ *      n: band of blocks around the coarse seam solved again at the next resolution (2 by default)
+ *      f: compare the coarse-to-fine cuts to the full resolution ones if set to 1 (0 by default)
+ *      p: scale down of the previews cut while a photo moves (4 by default, 1 for none), the pyramids of a bundle are
+ *         used when they have that level
+ *      d: time without any edit before the full resolution cut, in ms (300 by default)
+ *      u: memory of the tiles kept to undo the edits, in MB (64 by default, 0 for no undo)
  *
  * Usage:
- *      montage -i [number_of_photos] [photo_1] .. [photo_n] -o [output_file] -h [height] -w [weight]
+ *      montage -i [number_of_photos] [photo_1] .. [photo_n] -o [output_file] -h [height] -w [weight] -j [threads]
+ *              -g [solver] -c [reference] -l [levels] -n [band] -f [compare] -p [preview_factor] -d [idle]
+ *              -u [undo_memory]
  *
  * Ex:
  *      montage -i 2 photos/left.jpg photos/right.jpg -o results/montage.jpg -h 384 -w 512
@@ -20,6 +33,9 @@
  *      Move the trackbar to control the position
  *      Left click to setup constraint with small circle
  *      Right click to clean all existing constraints of that image
+ *      The photos are cut in the background, the image shows the last result with the time it took since the edit
+ *      Press u to undo the last edit and r to redo it, the positions and the constraints follow
+ *      Press another key to save the result
  *
  */
 
@@ -28,32 +44,68 @@
 #include <set>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include "compositor.h"
 #include "montage.h"
+#include "source_bundle.h"
 
 using namespace std;
 using namespace cv;
 
 Montage montage(600,1024); // the paint zone
+Montage preview(1, 1); // the paint zone scaled down, for the previews
+unique_ptr<Compositor> compositor; // cuts the montage in the background while the windows go on
 
 vector<Mat> photos; // list of photos
+vector<Mat> previews; // the photos scaled down
 vector<set<pair<int,int>>> constraints; // list of constraints for each image
 vector<int> photo_index; // list of consecutive numbers for mouse control
 vector<string> input_files; // name of photos
+vector<SourceBundle> bundles; // mapped bundles the photos read from
 int *value_row, *value_col; // ralative position of each image
+bool stepping = false; // the trackbars are set back by an undo or a redo
 
 const int range = 5; // use small circle instead of a single pixel for control
 
 /*
- * Method that combines all photos
+ * Method that combines all photos, only the photos from the first one moved or constrained since the last call are cut
+ * again. The request is handed to the compositor, which drops the one in progress.
  */
 void assemble() {
-    montage.reset();
-    for(int i = 0; i < photos.size(); i++)
-        montage.assemble(i, value_row[i], value_col[i], &constraints[i]);
-    montage.show();
+    vector<Placement> placements;
+    for(int i = 0; i < int(photos.size()); i++)
+        placements.push_back(Placement(i, value_row[i], value_col[i]));
+    compositor->submit(placements, constraints);
     // montage.save_mask("results/mask_montage.jpg");
 }
 
+/*
+ * Show a photo with its constraints marked in green
+ */
+void show_constraints(int index) {
+    Mat tmp = photos[index].clone();
+    for (auto px : constraints[index])
+        tmp.at<Vec3b>(px.first, px.second) = Vec3b(0, 255, 0); // mark the constraints in green
+    imshow(input_files[index] + to_string(index), tmp);
+}
+
+/*
+ * Set the positions and the constraints of the photos back to the ones of an undo or a redo, without a new request
+ */
+void restore(const vector<Placement> &placements, const vector<set<pair<int,int>>> &restored) {
+    stepping = true;
+    for (const Placement &p : placements) {
+        value_row[p.index] = p.row;
+        value_col[p.index] = p.col;
+        setTrackbarPos("Row", input_files[p.index] + to_string(p.index), p.row);
+        setTrackbarPos("Col", input_files[p.index] + to_string(p.index), p.col);
+        if (constraints[p.index] != restored[p.index]) {
+            constraints[p.index] = restored[p.index];
+            show_constraints(p.index);
+        }
+    }
+    stepping = false;
+}
+
 /*
  * Stardard callback for mouse event, add or remove constraints
  */
@@ -81,10 +133,7 @@ void on_mouse(int event, int x, int y, int, void* p) {
     }
 
     // redraw the image with constraints
-    Mat tmp = photos[*index].clone();
-    for (auto px : *constraint)
-        tmp.at<Vec3b>(px.first, px.second) = Vec3b(0, 255, 0); // mark the constraints in green
-    imshow(input_files[*index] + to_string(*index), tmp);
+    show_constraints(*index);
 
     assemble();
 
@@ -94,7 +143,8 @@ void on_mouse(int event, int x, int y, int, void* p) {
  * Callback for moving the picture, the value of trackbar has already been changed, no need to do anythhing
  */
 void on_trackbar(int, void*){
-    assemble();
+    if (!stepping)
+        assemble();
 }
 
 int main(int argc, char** argv) {
@@ -105,6 +155,15 @@ int main(int argc, char** argv) {
     int height = 480;
     int width = 800;
     int num_files = 0;
+    int threads = 1;
+    int solver = Boykov_Kolmogorov;
+    int reference = -1;
+    int levels = 1;
+    int band = 2;
+    int compare = 0;
+    int factor = 4;
+    int idle = 300;
+    int undo = 64;
 
     for (int i = 1; i < argc; i++)
         switch (argv[i][1]) {
@@ -123,22 +182,86 @@ int main(int argc, char** argv) {
             case 'w':
                 width = atoi(argv[++i]);
                 break;
+            case 'j':
+                threads = atoi(argv[++i]);
+                break;
+            case 'g':
+                solver = atoi(argv[++i]);
+                break;
+            case 'c':
+                reference = atoi(argv[++i]);
+                break;
+            case 'l':
+                levels = atoi(argv[++i]);
+                break;
+            case 'n':
+                band = atoi(argv[++i]);
+                break;
+            case 'f':
+                compare = atoi(argv[++i]);
+                break;
+            case 'p':
+                factor = atoi(argv[++i]);
+                break;
+            case 'd':
+                idle = atoi(argv[++i]);
+                break;
+            case 'u':
+                undo = atoi(argv[++i]);
+                break;
             default:
                 return EXIT_FAILURE;
         }
 
+    if (threads < 1 || levels < 1 || band < 1 || factor < 1 || idle < 0 || undo < 0)
+        return EXIT_FAILURE;
+    if (solver < Boykov_Kolmogorov || solver > Incremental_BFS || reference > Incremental_BFS)
+        return EXIT_FAILURE;
+    if (reference < 0)
+        reference = solver;
+    setNumThreads(threads);
+
     int extra_height = height / 6; // extra space to manipulate the nap
     int extra_width = width / 6;
+    if (factor > min(extra_height, extra_width)) // the scaled down nap needs an extra area
+        factor = 1;
 
     // preparation
 
+    int level = 0; // of the pyramids of the bundles matching the previews
+    while ((2 << level) <= factor)
+        level++;
+    if ((1 << level) != factor)
+        level = -1;
+
+    vector<string> files;
+    files.swap(input_files);
+    for (const string &file : files) {
+        if (!is_bundle(file)) {
+            input_files.push_back(file);
+            photos.push_back(imread(file, CV_LOAD_IMAGE_COLOR));
+            previews.push_back(Mat());
+            continue;
+        }
+        bundles.emplace_back();
+        if (!bundles.back().open(file))
+            return EXIT_FAILURE;
+        for (int k = 0; k < bundles.back().images(); k++) {
+            input_files.push_back(file);
+            photos.push_back(bundles.back().get("image/" + to_string(k)));
+            previews.push_back(bundles.back().get("image/" + to_string(k) + "/" + to_string(level)));
+        }
+    }
+    num_files = int(photos.size());
+    for (int i = 0; i < num_files && factor > 1; i++)
+        if (previews[i].size() != Size(photos[i].cols / factor, photos[i].rows / factor))
+            resize(photos[i], previews[i], Size(photos[i].cols / factor, photos[i].rows / factor), 0, 0, INTER_AREA);
+
     photo_index.clear();
     for (int i = 0; i < num_files; i++) {
         photo_index.push_back(i);
-        Mat img = imread(input_files[i], CV_LOAD_IMAGE_COLOR);
-        photos.push_back(img);
-        height = max(height, img.rows);
-        width = max(width, img.cols);
+        height = max(height, photos[i].rows);
+        width = max(width, photos[i].cols);
         // add new set of constraints
         set<pair<int,int>> constraint;
         constraints.push_back(constraint);
@@ -151,6 +274,15 @@ int main(int argc, char** argv) {
 
     Mat output(height, width, CV_8UC3);
     montage = Montage(height, width, extra_height, extra_width);
+    montage.set_threads(threads);
+    montage.set_solver(Solver_Type(solver), Solver_Type(reference));
+    montage.set_keep_cuts(true);
+    montage.set_levels(levels, band, compare != 0);
+    montage.set_history(size_t(undo) << 20);
+    preview = Montage(height / factor, width / factor, extra_height / factor, extra_width / factor);
+    preview.set_threads(threads);
+    preview.set_solver(Solver_Type(solver), Solver_Type(reference));
+    preview.set_keep_cuts(true);
 
     // add control panels
 
@@ -158,6 +290,7 @@ int main(int argc, char** argv) {
         namedWindow(input_files[i] + to_string(i), CV_GUI_NORMAL);
         imshow(input_files[i] + to_string(i), photos[i]);
         montage.add_photo(photos[i]);
+        preview.add_photo(factor > 1 ? previews[i] : photos[i]);
         // set random position at first
         value_row[i] = rand() % (height + extra_height * 2 - photos[i].rows);
         value_col[i] = rand() % (width + extra_width * 2 - photos[i].cols);
@@ -168,12 +301,27 @@ int main(int argc, char** argv) {
         setMouseCallback(input_files[i] + to_string(i), on_mouse, &photo_index[i]);
     }
 
+    // show the results as they come until a key other than undo and redo is pressed
+
+    compositor.reset(new Compositor(montage, &preview, factor, idle));
     assemble();
-    waitKey(0);
+    vector<Placement> placements;
+    vector<set<pair<int,int>>> restored;
+    for (int key = -1; key < 0 || key == 'u' || key == 'r'; key = waitKey(10)) {
+        if (key >= 0)
+            compositor->step(key == 'u' ? -1 : 1);
+        compositor->present();
+        if (compositor->stepped(placements, restored))
+            restore(placements, restored);
+    }
 
     // retrieve the result
 
+    compositor->wait();
+    compositor.reset();
     montage.save_output(output);
+    if (compare && levels > 1)
+        cout << "coarse-to-fine cuts cost " << montage.cut_excess() * 100 << "% more than full resolution" << endl;
 
     imwrite(output_file, output);
 
@@ -0,0 +1,178 @@
+//
+// Highest-label push-relabel max-flow with global relabeling
+//
+
+#include <algorithm>
+#include "push_relabel.h"
+
+int PushRelabel::solve(const GridGraph &grid, int) {
+    flow = build(grid);
+
+    excess.resize(num_node);
+    label.resize(num_node);
+    current.resize(num_node);
+    next.resize(num_node);
+    prev.resize(num_node);
+    unreachable = num_node + 1;
+    buckets.resize(num_node + 1);
+
+    // saturate every arc leaving the source
+
+    for (int v = 0; v < num_node; v++) {
+        excess[v] = max(tr_cap[v], 0);
+        tr_cap[v] = min(tr_cap[v], 0);
+    }
+
+    global_relabel();
+    int relabel_work = 6 * num_node + int(head.size());
+    while (max_active > 0 && !cancelled()) {
+        int v = buckets[max_active].active;
+        if (v < 0) {
+            max_active--;
+            continue;
+        }
+        buckets[max_active].active = next[v];
+        discharge(v);
+        if (work > relabel_work)
+            global_relabel();
+    }
+
+    find_sink_side();
+    return flow;
+}
+
+size_t PushRelabel::memory() const {
+    return ArcSolver::memory() + buckets.capacity() * sizeof(Bucket) +
+           (excess.capacity() + label.capacity() + current.capacity() + next.capacity() + prev.capacity() +
+            order.capacity()) * sizeof(int);
+}
+
+inline void PushRelabel::add_active(int v) {
+    Bucket &b = buckets[label[v]];
+    next[v] = b.active;
+    b.active = v;
+    max_active = max(max_active, label[v]);
+}
+
+inline void PushRelabel::add_inactive(int v) {
+    Bucket &b = buckets[label[v]];
+    next[v] = b.inactive;
+    prev[v] = -1;
+    if (b.inactive >= 0)
+        prev[b.inactive] = v;
+    b.inactive = v;
+}
+
+inline void PushRelabel::remove_inactive(int v) {
+    if (prev[v] >= 0)
+        next[prev[v]] = next[v];
+    else
+        buckets[label[v]].inactive = next[v];
+    if (next[v] >= 0)
+        prev[next[v]] = prev[v];
+}
+
+void PushRelabel::global_relabel() {
+    // exact distances to the sink, by a backward breadth-first search
+
+    fill(label.begin(), label.end(), unreachable);
+    order.clear();
+    for (int v = 0; v < num_node; v++)
+        if (tr_cap[v] < 0) {
+            label[v] = 1;
+            order.push_back(v);
+        }
+
+    for (size_t k = 0; k < order.size(); k++) {
+        int v = order[k];
+        for (int a = first[v]; a < first[v + 1]; a++) {
+            int u = head[a];
+            if (label[u] == unreachable && r_cap[sister[a]] > 0) {
+                label[u] = label[v] + 1;
+                order.push_back(u);
+            }
+        }
+    }
+
+    // the nodes which cannot reach the sink are left out of the buckets for good
+
+    Bucket empty = {-1, -1};
+    fill(buckets.begin(), buckets.end(), empty);
+    max_active = max_label = 0;
+    for (int v : order) {
+        current[v] = first[v];
+        if (excess[v] > 0)
+            add_active(v);
+        else
+            add_inactive(v);
+        max_label = label[v];
+    }
+    work = 0;
+}
+
+void PushRelabel::gap(int l) {
+    for (int k = l + 1; k <= max_label; k++) {
+        for (int v = buckets[k].active; v >= 0; v = next[v])
+            label[v] = unreachable;
+        for (int v = buckets[k].inactive; v >= 0; v = next[v])
+            label[v] = unreachable;
+        buckets[k].active = buckets[k].inactive = -1;
+    }
+    max_label = l - 1;
+    max_active = min(max_active, max_label);
+}
+
+void PushRelabel::discharge(int v) {
+    while (excess[v] > 0) {
+        // push to the sink
+
+        if (label[v] == 1 && tr_cap[v] < 0) {
+            int delta = min(excess[v], -tr_cap[v]);
+            tr_cap[v] += delta;
+            excess[v] -= delta;
+            flow += delta;
+            continue;
+        }
+
+        // push along the current arc if it is admissible, otherwise look for the next one
+
+        int a = current[v], end = first[v + 1];
+        while (a < end && !(r_cap[a] > 0 && label[head[a]] == label[v] - 1))
+            a++;
+        if (a < end) {
+            int w = head[a];
+            int delta = min(excess[v], r_cap[a]);
+            r_cap[a] -= delta;
+            r_cap[sister[a]] += delta;
+            excess[v] -= delta;
+            if (excess[w] == 0) {
+                remove_inactive(w);
+                add_active(w);
+            }
+            excess[w] += delta;
+            current[v] = a;
+            continue;
+        }
+
+        // relabel, v is in no bucket while it is discharged so it was the last node of its label if the bucket is empty
+
+        const Bucket &b = buckets[label[v]];
+        if (b.active < 0 && b.inactive < 0) {
+            gap(label[v]);
+            label[v] = unreachable;
+            return;
+        }
+
+        int l = tr_cap[v] < 0 ? 1 : unreachable;
+        for (a = first[v]; a < end; a++)
+            if (r_cap[a] > 0)
+                l = min(l, label[head[a]] + 1);
+        label[v] = l;
+        current[v] = first[v];
+        work += end - first[v] + 12;
+        if (l == unreachable)
+            return;
+        max_label = max(max_label, l);
+    }
+    add_inactive(v);
+}
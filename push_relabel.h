@@ -0,0 +1,53 @@
+//
+// Highest-label push-relabel max-flow with global relabeling
+//
+
+#ifndef PUSH_RELABEL_H
+#define PUSH_RELABEL_H
+
+#include <vector>
+#include "cut_solver.h"
+
+using namespace std;
+
+/*
+ * Only the first phase of push-relabel is run: it ends with a maximum preflow, where the nodes left with an excess
+ * cannot reach the sink any more. That is enough for both the flow value and the cut, the excess never needs to be
+ * returned to the source.
+ *
+ * Labels are distances to the sink, num_node + 1 meaning that the node cannot reach it. The active node with the
+ * highest label is always discharged first, and every label is recomputed exactly by a backward breadth-first search
+ * from the sink once the relabel operations have done about as much work as that search. When a relabel empties a
+ * label, every node above it is cut from the sink and leaves the buckets at once (gap heuristic).
+ */
+class PushRelabel : public ArcSolver {
+public:
+    int solve(const GridGraph &grid, int threads = 1);
+    size_t memory() const;
+
+private:
+    // Nodes of one label, the active ones in a stack and the others in a doubly linked list
+    struct Bucket {
+        int active, inactive;
+    };
+
+    vector<int> excess, label;
+    vector<int> current; // current arc of every node
+    vector<int> next, prev; // links of the node in its bucket
+    vector<Bucket> buckets;
+    vector<int> order; // of the global relabel
+    int unreachable = 0; // label of the nodes which cannot reach the sink
+    int max_active = 0; // no active node has a higher label
+    int max_label = 0; // no node below unreachable has a higher label
+    int work = 0; // done since the last global relabel
+    int flow = 0;
+
+    inline void add_active(int v);
+    inline void add_inactive(int v);
+    inline void remove_inactive(int v);
+    void global_relabel();
+    void gap(int l); // no node is left with label l
+    void discharge(int v);
+};
+
+#endif //PUSH_RELABEL_H
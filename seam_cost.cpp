@@ -0,0 +1,105 @@
+//
+// Matching cost of the seams between the new patch and the existing nap
+//
+
+#include <algorithm>
+#include "seam_cost.h"
+#include "parallel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const int chunk = 256; // pixels processed per pass, keeps the scratch buffers on the stack
+
+// squares of the channel differences, 3 * 255^2 fits in an unsigned short
+static inline void square_diff(const uchar *a, const uchar *b, ushort *square, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+        __m256i d = _mm256_sub_epi16(x, y);
+        _mm256_storeu_si256((__m256i *)(square + i), _mm256_mullo_epi16(d, d));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + i)), zero);
+        __m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + i)), zero);
+        __m128i d = _mm_sub_epi16(x, y);
+        _mm_storeu_si128((__m128i *)(square + i), _mm_mullo_epi16(d, d));
+    }
+#endif
+    for (; i < n; i++) {
+        int d = int(a[i]) - int(b[i]);
+        square[i] = ushort(d * d);
+    }
+}
+
+// truncated square roots, in place
+static inline void int_sqrt(int *x, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(x + i)));
+        _mm256_storeu_si256((__m256i *)(x + i), _mm256_cvttps_epi32(_mm256_sqrt_ps(v)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(x + i)));
+        _mm_storeu_si128((__m128i *)(x + i), _mm_cvttps_epi32(_mm_sqrt_ps(v)));
+    }
+#endif
+    for (; i < n; i++)
+        x[i] = int(std::sqrt(float(x[i])));
+}
+
+void color_distance(const uchar *a, const uchar *b, int *distance, int n) {
+    ushort square[chunk * 3];
+    for (int start = 0; start < n; start += chunk) {
+        int count = std::min(chunk, n - start);
+        square_diff(a + start * 3, b + start * 3, square, count * 3);
+        for (int i = 0; i < count; i++)
+            distance[start + i] = square[3 * i] + square[3 * i + 1] + square[3 * i + 2];
+        int_sqrt(distance + start, count);
+    }
+}
+
+// Point plane to the top-left rows x cols corner of storage, which is only reallocated when it is too small
+static void view(Mat &storage, Mat &plane, int rows, int cols) {
+    if (rows <= 0 || cols <= 0) {
+        plane.release();
+        return;
+    }
+    if (rows > storage.rows || cols > storage.cols)
+        storage.create(std::max(rows, storage.rows), std::max(cols, storage.cols), CV_32S);
+    plane = storage(Rect(0, 0, cols, rows));
+}
+
+void SeamCost::compute(const Mat &patch, const Mat &canvas) {
+    CV_Assert(patch.type() == CV_8UC3 && canvas.type() == CV_8UC3 && patch.size() == canvas.size());
+
+    view(planes[0], distance, patch.rows, patch.cols);
+    view(planes[1], right, patch.rows, patch.cols - 1);
+    view(planes[2], down, patch.rows - 1, patch.cols);
+    parallel_rows(patch.rows, [&](int row) {
+        color_distance(patch.ptr<uchar>(row), canvas.ptr<uchar>(row), distance.ptr<int>(row), patch.cols);
+    });
+
+    // edge costs are sums of two neighbouring distances, written in place since the views already have the right size
+
+    if (patch.cols > 1)
+        add(distance.colRange(0, patch.cols - 1), distance.colRange(1, patch.cols), right);
+    if (patch.rows > 1)
+        add(distance.rowRange(0, patch.rows - 1), distance.rowRange(1, patch.rows), down);
+}
+
+size_t SeamCost::memory() const {
+    size_t bytes = 0;
+    for (const Mat &plane : planes)
+        bytes += plane.total() * plane.elemSize();
+    return bytes;
+}
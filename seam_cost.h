@@ -0,0 +1,42 @@
+//
+// Matching cost of the seams between the new patch and the existing nap
+//
+
+#ifndef SEAM_COST_H
+#define SEAM_COST_H
+
+#include <cmath>
+#include <opencv2/core/core.hpp>
+
+using namespace cv;
+
+// Return int(|a - b|), the sqrt of an integer below 3 * 255^2 is exact in single precision
+inline int color_norm(const Vec3b &a, const Vec3b &b) {
+    int x = int(a[0]) - int(b[0]);
+    int y = int(a[1]) - int(b[1]);
+    int z = int(a[2]) - int(b[2]);
+    return int(std::sqrt(float(x * x + y * y + z * z)));
+}
+
+/*
+ * Cost planes of one assemble call over the rectangle of the patch. When two neighbours of the overlap come from the
+ * same photo, the cost of cutting between them is the sum of the distances between the patch and the nap at both
+ * pixels, so it is computed once here instead of once per edge.
+ */
+class SeamCost {
+public:
+    Mat distance; // CV_32S, distance[row,col] = |patch[row,col] - nap[row,col]|
+    Mat right; // CV_32S, rows x (cols - 1), cost of the edge between [row,col] and [row,col+1]
+    Mat down; // CV_32S, (rows - 1) x cols, cost of the edge between [row,col] and [row+1,col]
+
+    void compute(const Mat &patch, const Mat &canvas); // canvas is the area of the nap under the patch
+    size_t memory() const; // bytes currently allocated
+
+private:
+    Mat planes[3]; // storage of the three planes above, grown to the largest patch seen so far
+};
+
+// Per-pixel distance of two CV_8UC3 rows of n pixels
+void color_distance(const uchar *a, const uchar *b, int *distance, int n);
+
+#endif //SEAM_COST_H
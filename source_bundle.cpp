@@ -0,0 +1,141 @@
+//
+// Decoded sources and their precomputed planes, in a file mapped at start-up
+//
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <opencv2/highgui/highgui.hpp>
+#include "source_bundle.h"
+
+static const size_t page = 4096, row_alignment = 64;
+static const char magic[8] = {'M', 'O', 'N', 'T', 'B', 'N', 'D', 'L'};
+static const unsigned version = 1;
+
+struct BundleHeader {
+    char magic[8];
+    unsigned version;
+    int count; // of entries
+    long long directory; // offset of the entries, after the matrices
+};
+
+// An entry of the directory, followed by its name
+struct BundleEntry {
+    int type, rows, cols, name_size;
+    long long step, offset;
+};
+
+bool SourceBundle::write(const string &path) const {
+    string temporary = path + ".tmp";
+    FILE *f = fopen(temporary.c_str(), "wb");
+    if (!f)
+        return false;
+
+    BundleHeader header;
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.count = int(entries.size());
+    vector<char> zeros(page, 0), directory;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(zeros.data(), page - sizeof(header), 1, f) == 1;
+    long long end = page;
+
+    for (const auto &e : entries) {
+        const Mat &m = e.second;
+        size_t row = m.cols * m.elemSize(), step = (row + row_alignment - 1) / row_alignment * row_alignment;
+        BundleEntry entry = {m.type(), m.rows, m.cols, int(e.first.size()), (long long)step, end};
+        const char *p = (const char *)&entry;
+        directory.insert(directory.end(), p, p + sizeof(entry));
+        directory.insert(directory.end(), e.first.begin(), e.first.end());
+
+        for (int r = 0; r < m.rows && ok; r++)
+            ok = fwrite(m.ptr(r), row, 1, f) == 1 && (step == row || fwrite(zeros.data(), step - row, 1, f) == 1);
+        end += (long long)(step * m.rows);
+        size_t padding = size_t((page - end % page) % page);
+        ok = ok && (padding == 0 || fwrite(zeros.data(), padding, 1, f) == 1);
+        end += (long long)padding;
+    }
+
+    header.directory = end;
+    ok = ok && (directory.empty() || fwrite(directory.data(), directory.size(), 1, f) == 1);
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool SourceBundle::open(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *address = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= page)
+        address = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        return false;
+    size_t length = size_t(st.st_size);
+    shared_ptr<uchar> mapped((uchar *)address, [length](uchar *p) { munmap(p, length); });
+
+    BundleHeader header;
+    memcpy(&header, mapped.get(), sizeof(header));
+    if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version || header.count < 0
+        || header.directory < 0 || size_t(header.directory) > length)
+        return false;
+
+    // every matrix must lie within the file
+
+    map<string, Mat> found;
+    size_t at = size_t(header.directory);
+    for (int i = 0; i < header.count; i++) {
+        BundleEntry entry;
+        if (at + sizeof(entry) > length)
+            return false;
+        memcpy(&entry, mapped.get() + at, sizeof(entry));
+        at += sizeof(entry);
+        if (entry.name_size < 0 || at + size_t(entry.name_size) > length || entry.rows < 0 || entry.cols < 0
+            || entry.offset < 0 || entry.step < 0 || entry.type < 0 || entry.type >= CV_MAKETYPE(CV_64F, 4)
+            || CV_MAT_DEPTH(entry.type) > CV_64F)
+            return false;
+
+        // each bound is checked against the length on its own, so that no product can wrap around
+
+        size_t offset = size_t(entry.offset), step = size_t(entry.step);
+        if (offset > length || step < size_t(entry.cols) * CV_ELEM_SIZE(entry.type)
+            || step % CV_ELEM_SIZE1(entry.type) != 0
+            || (entry.rows > 0 && step > (length - offset) / size_t(entry.rows)))
+            return false;
+        string name((const char *)mapped.get() + at, size_t(entry.name_size));
+        at += size_t(entry.name_size);
+        found[name] = Mat(entry.rows, entry.cols, entry.type, mapped.get() + offset, step);
+    }
+    entries.swap(found);
+    mapping = mapped;
+    return true;
+}
+
+Mat SourceBundle::get(const string &name) const {
+    auto e = entries.find(name);
+    return e == entries.end() ? Mat() : e->second;
+}
+
+int SourceBundle::images() const {
+    int k = 0;
+    while (has("image/" + to_string(k)))
+        k++;
+    return k;
+}
+
+bool is_bundle(const string &path) {
+    const string extension = ".bundle";
+    return path.size() > extension.size() && path.compare(path.size() - extension.size(), extension.size(),
+                                                          extension) == 0;
+}
+
+Mat load_image(const string &path, SourceBundle &bundle) {
+    if (!is_bundle(path))
+        return imread(path, IMREAD_COLOR);
+    return bundle.open(path) ? bundle.get("image/0") : Mat();
+}
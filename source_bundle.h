@@ -0,0 +1,47 @@
+//
+// Decoded sources and their precomputed planes, in a file mapped at start-up
+//
+
+#ifndef SOURCE_BUNDLE_H
+#define SOURCE_BUNDLE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/*
+ * A bundle is a set of named matrices: the decoded images, their pyramids, and the planes and spectra the patch
+ * matchers compute from a sample. Every matrix starts on a page and its rows on 64 bytes, so a loaded bundle gives
+ * Mat headers on its mapping without copying or decoding anything, the pages are read when the matrices are used.
+ *
+ * The matrices of a loaded bundle are read-only and live as long as the bundle.
+ *
+ * Names used by the tools:
+ *      image/<k>               the k-th image, CV_8UC3
+ *      image/<k>/<l>           its level l of a pyramid halving the size from level 1
+ *      sub/<range>/...         planes of a SubPatchMatcher for the first image and this rotation range
+ *      entire/<w>x<h>/...      spectra of a PatchMatcher for the first image and this canvas size
+ */
+class SourceBundle {
+public:
+    bool open(const string &path); // map a bundle, false if it is missing or not valid
+    bool write(const string &path) const;
+
+    void add(const string &name, const Mat &m) { entries[name] = m; }
+    bool has(const string &name) const { return entries.count(name) > 0; }
+    Mat get(const string &name) const; // an empty matrix if it is missing
+    int images() const; // number of images/<k>
+
+private:
+    map<string, Mat> entries;
+    shared_ptr<uchar> mapping;
+};
+
+bool is_bundle(const string &path); // by its extension, .bundle
+Mat load_image(const string &path, SourceBundle &bundle); // the first image of a bundle, or a decoded image file
+
+#endif //SOURCE_BUNDLE_H
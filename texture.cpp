@@ -5,19 +5,40 @@
  * a 2003 paper "Graphcut Textures: Image and Video Synthesis Using Graph Cut".
  *
  * Parameters:
- *      i: path to the sample png image (with a smaller dimension)
+ *      i: path to the sample png image (with a smaller dimension), or to a bundle made by the bundle tool, whose
+ *         planes of the patch matching are used if it has them for this size and range
  *      o: path to the output png image
  *      h: height of output image
  *      w: width of output image
  *      s: scaling factor in float ((0, 0) is set to 1, (a, d * a) is set to scale ^ a)
  *      d: scaling direction in tangent form (d = delta_y / delta_x)
- *      m: patch finding mode (0 for Random placement, 1 for Entire patch matching, or 2 for Sub-patch matching)
+ *      m: patch finding mode (0 for Random placement, 1 for Entire patch matching, or 2 for Sub-patch matching), the
+ *         patches placed by patch matching are not scaled, sub-patch matching tries a few rotations within the range
  *      t: number of iterations
  *      r: rotation range
+ *      j: number of threads (1 by default)
+ *      g: max-flow engine (0 for Boykov-Kolmogorov, 1 for the grid engine by default, 2 for push-relabel, 3 for IBFS)
+ *      c: engine checking every cut of the first one, in the same encoding (none by default)
+ *      e: seed of the random placements (1 by default), the output only depends on it and not on the threads
+ *      b: memory budget of the resized and rotated samples kept for reuse, in MB (64 by default)
+ *      l: number of resolutions of the coarse-to-fine cuts (1 by default, for a single cut at full resolution)
+ *      n: band of blocks around the coarse seam solved again at the next resolution (2 by default)
+ *      f: compare the coarse-to-fine cuts to the full resolution ones if set to 1 (0 by default)
+ *      p: leave the pixels pinned to a side out of the graphs if >= 0 (by default, the cut is the same), and tie the
+ *         pixels farther than p from the border of the patch and of the filled area to the patch if > 0
+ *      q: seam engine (0 for seam paths on the thin strips and max-flow elsewhere by default, 1 for max-flow only,
+ *         2 for seam paths on every strip)
+ *      k: memory budget of the tiles of the nap kept in memory, in MB (0 by default, for no limit), the others are
+ *         spilled to a scratch file; the tiles under the patches being cut are kept on top of it
+ *      u: checkpoint file, the job resumes from it if it exists and is written again at the end
+ *      v: iterations between two checkpoints (0 by default, for the last one only)
  *
  * Usage:
  *      texture -i [input_file] -o [output_file] -h [height] -w [weight] -s [scale] -d [direction] -m [patch_mode]
- *              -t [iteration] -r [rotation_range]
+ *              -t [iteration] -r [rotation_range] -j [threads] -g [solver] -c [reference] -e [seed]
+ *              -b [cache_budget] -l [levels] -n [band] -f [compare]
+ *              -p [pin_band] -q [seam_engine] -k [canvas_budget]
+ *              -u [checkpoint] -v [period]
  *
  * Example:
  *      texture -i samples/floor.jpg -o results/floor.jpg -h 256 -w 256
@@ -26,19 +47,32 @@
  */
 
 #include <iostream>
+#include <random>
+#include <sstream>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "montage.h"
+#include "patch_match.h"
+#include "source_bundle.h"
+#include "transform_cache.h"
 
 using namespace std;
 using namespace cv;
 
-enum Patch_Mode {Random, Entire, Sub_Match}; // only the random method has been implemented
+enum Patch_Mode {Random, Entire, Sub_Match};
 
 /**
  * Texture generation function: the input and output matrix must be allocated with a valid dimension before calling
  * this function
+ *
+ * With several threads, batches of random placements are drawn ahead and the ones which do not overlap are cut in
+ * parallel, the others are tried again with the next batch. The result is the same as placing them one by one. A
+ * matched placement depends on the nap left by the previous one, so they are not drawn ahead.
  */
-void generate(Mat& input, Mat& output, int iteration, float scaling_factor, float dir, Patch_Mode patch_mode = Random, int range = 0) {
+void generate(Mat& input, Mat& output, int iteration, float scaling_factor, float dir, Patch_Mode patch_mode = Random, int range = 0, int threads = 1,
+              Solver_Type solver = Grid_Cut, Solver_Type reference = Grid_Cut, unsigned seed = 1,
+              size_t cache_budget = size_t(64) << 20, int levels = 1, int band = 2, bool compare = false,
+              int pin_band = 0, Seam_Engine seam_engine = Auto_Seam, size_t canvas_budget = 0,
+              const string &checkpoint = "", int period = 0, const SourceBundle *bundle = NULL) {
 
     int height = output.rows;
     int width = output.cols;
@@ -46,39 +80,136 @@ void generate(Mat& input, Mat& output, int iteration, float scaling_factor, floa
     // prepare the nap
 
     Montage montage(height, width, height / 3, width / 3);
-    montage.add_photo(input);
-    montage.reset();
-    montage.assemble(0, 0, 0); // add the first image
+    montage.set_threads(threads);
+    montage.set_solver(solver, reference);
+    montage.set_levels(levels, band, compare);
+    montage.set_band(pin_band);
+    montage.set_seam_engine(seam_engine);
+    montage.set_canvas_budget(canvas_budget);
 
-    // loop in order to cover the whole image
+    // resume from the checkpoint, which holds the random generator and the iterations left, or add the first image
 
+    mt19937 random(seed);
     int count  = 1;
-    while (iteration--) {
-        int row = rand() % (height + height / 3 * 2); // random point on the whole nap
-        int col = rand() % (width + width / 3 * 2);
-        int rotation = (range > 0) ? rand() % range : 0; // add random rotation
+    string state;
+    bool resumed = !checkpoint.empty() && montage.load_checkpoint(checkpoint, state);
+    if (resumed) {
+        istringstream in(state);
+        in >> random >> iteration >> count;
+        cout << "resumed from " << checkpoint << " with " << iteration << " iterations left" << endl;
+    } else {
+        montage.add_photo(input);
+        montage.reset();
+        montage.assemble(0, 0, 0);
+    }
+
+    // loop in order to cover the whole image
+
+    size_t batch_size = (threads > 1 && patch_mode == Random) ? size_t(threads) * 4 : 1;
+    Size canvas_size(width + width / 3 * 2, height + height / 3 * 2);
+    unique_ptr<PatchMatcher> matcher;
+    unique_ptr<SubPatchMatcher> sub_matcher;
+    if (patch_mode == Entire)
+        matcher.reset(new PatchMatcher(input, canvas_size, 0.1, bundle));
+    if (patch_mode == Sub_Match)
+        sub_matcher.reset(new SubPatchMatcher(input, range, bundle));
+    Mat canvas, filled;
+    vector<Placement> batch;
+
+    // without scaling every rotation is known in advance, transform as many as the cache holds at once
+
+    shared_ptr<TransformCache> cache;
+    int source = 0;
+    if (resumed && montage.source_count() > 0) {
+        cache = montage.get_source(source);
+    } else {
+        cache = make_shared<TransformCache>(input, cache_budget);
+        source = montage.add_source(cache);
+    }
+    if (scaling_factor == 0 && patch_mode == Random) {
+        size_t fit = cache_budget / max(input.total() * input.elemSize(), size_t(1));
+        vector<pair<Size,int>> keys;
+        for (int rotation = 0; rotation < max(range, 1) && keys.size() < fit && int(keys.size()) < iteration;
+             rotation++)
+            keys.push_back(make_pair(input.size(), rotation));
+        cache->prewarm(keys);
+    }
+
+    int saved = count;
+    auto save = [&]() {
+        while (!batch.empty())
+            montage.assemble(batch);
+        ostringstream out;
+        out << random << ' ' << iteration << ' ' << count;
+        montage.save_checkpoint(checkpoint, out.str());
+        saved = count;
+    };
+
+    while (iteration > 0 || !batch.empty()) {
+        if (iteration == 0 || batch.size() == batch_size) {
+            montage.assemble(batch);
+            continue;
+        }
+        if (!checkpoint.empty() && period > 0 && (count - 1) % period == 0 && count != saved)
+            save(); // the placements drawn ahead are assembled first, the nap is the same
+        iteration--;
+
+        // entire patch matching places the sample itself, sub-patch matching one of its rotations
+
+        int row, col, candidate;
+        if (matcher) {
+            montage.get_canvas(canvas, filled);
+            if (matcher->pick(canvas, filled, random, row, col)) {
+                montage.add_photo(input);
+                batch.push_back(Placement(count++, row, col));
+                continue;
+            }
+        }
+        if (sub_matcher) {
+            montage.get_canvas(canvas, filled);
+            if (sub_matcher->pick(canvas, filled, random, candidate, row, col)) {
+                montage.add_photo(sub_matcher->sample(candidate));
+                batch.push_back(Placement(count++, row, col));
+                continue;
+            }
+        }
+
+        row = int(random() % canvas_size.height); // random point on the whole nap
+        col = int(random() % canvas_size.width);
+        int rotation = (range > 0) ? int(random() % range) : 0; // add random rotation
 
         float distance = float((row + col * dir) / sqrt(1.0 + dir * dir));
         float resize_factor = pow(scaling_factor,(distance/height));
         if (scaling_factor == 0)
             resize_factor = 1;
 
-        Size size(int(input.cols * resize_factor), int(input.rows * resize_factor));
-        Mat tmp;
-        resize(input, tmp, size);
-
-        // rotate the image
-
-        Point2f pc(tmp.cols / 2.0f, tmp.rows / 2.0f);
-        Mat r = getRotationMatrix2D(pc, rotation, 1.0);
-        warpAffine(tmp, tmp, r, tmp.size());
+        // the montage resizes and rotates the image when it needs its pixels, or reuses the same transform
 
-        montage.add_photo(tmp);
-        montage.assemble(count++, row, col);
+        Size size(int(input.cols * resize_factor), int(input.rows * resize_factor));
+        montage.add_patch(source, size, rotation);
+        batch.push_back(Placement(count++, row, col));
     }
 
     montage.save_output(output);
+    if (!checkpoint.empty()) {
+        save();
+        if (!montage.wait_checkpoint())
+            cout << "could not write " << checkpoint << endl;
+    }
     // montage.save_mask("results/mask.jpg");
+    cout << "graph cuts used at most " << montage.peak_memory() / 1024 << " KB" << endl;
+    if (compare && levels > 1)
+        cout << "coarse-to-fine cuts cost " << montage.cut_excess() * 100 << "% more than full resolution" << endl;
+    cout << "tiles of the nap used at most " << montage.canvas_memory() / 1024 << " KB";
+    if (canvas_budget > 0)
+        cout << ", up to " << montage.canvas_locked_memory() / 1024 << " KB locked under the patches being cut";
+    if (montage.canvas_spills() > 0)
+        cout << ", spilled " << montage.canvas_spills() << " times";
+    cout << endl;
+    if (montage.strip_count() > 0)
+        cout << montage.strip_count() << " strip overlaps cut by a seam path" << endl;
+    if (cache->hits() + cache->misses() > 0)
+        cout << "transformed samples reused " << int(cache->hit_rate() * 100) << "% of the time" << endl;
 
 }
 
@@ -98,6 +229,19 @@ int main(int argc, char** argv) {
     Patch_Mode patch_mode = Random;
     int iteration = 0;
     int range = 0;
+    int threads = 1;
+    int solver = Grid_Cut;
+    int reference = -1;
+    unsigned seed = 1;
+    int budget = 64;
+    int levels = 1;
+    int band = 2;
+    int compare = 0;
+    int pin_band = 0;
+    int seam_engine = Auto_Seam;
+    int canvas_budget = 0;
+    string checkpoint;
+    int period = 0;
 
     for (int i = 1; i < argc; i++)
         switch (argv[i][1]) {
@@ -128,23 +272,75 @@ int main(int argc, char** argv) {
             case 'r':
                 range = atoi(argv[++i]);
                 break;
+            case 'j':
+                threads = atoi(argv[++i]);
+                break;
+            case 'g':
+                solver = atoi(argv[++i]);
+                break;
+            case 'c':
+                reference = atoi(argv[++i]);
+                break;
+            case 'e':
+                seed = unsigned(atoi(argv[++i]));
+                break;
+            case 'b':
+                budget = atoi(argv[++i]);
+                break;
+            case 'l':
+                levels = atoi(argv[++i]);
+                break;
+            case 'n':
+                band = atoi(argv[++i]);
+                break;
+            case 'f':
+                compare = atoi(argv[++i]);
+                break;
+            case 'p':
+                pin_band = atoi(argv[++i]);
+                break;
+            case 'q':
+                seam_engine = atoi(argv[++i]);
+                break;
+            case 'k':
+                canvas_budget = atoi(argv[++i]);
+                break;
+            case 'u':
+                checkpoint = argv[++i];
+                break;
+            case 'v':
+                period = atoi(argv[++i]);
+                break;
             default:
                 return EXIT_FAILURE;
         }
 
-    if (input_file == "" || output_file == "" || height == 0 || width == 0)
+    if (input_file == "" || output_file == "" || height == 0 || width == 0 || threads < 1 || budget < 0 || levels < 1 ||
+        band < 1 || canvas_budget < 0 || period < 0)
         return EXIT_FAILURE;
+    if (solver < Boykov_Kolmogorov || solver > Incremental_BFS || reference > Incremental_BFS || seam_engine < Auto_Seam
+        || seam_engine > Path_Seam)
+        return EXIT_FAILURE;
+    if (reference < 0)
+        reference = solver;
+    setNumThreads(threads);
 
     // allocate the memory and load the image
 
-    Mat input = imread(input_file, IMREAD_COLOR);
+    SourceBundle bundle;
+    Mat input = load_image(input_file, bundle);
+    if (input.empty())
+        return EXIT_FAILURE;
     Mat output(height, width, CV_8UC3);
 
     imshow(input_file, input);
 
     // call the function
 
-    generate(input, output, iteration, scale, direction, patch_mode, range);
+    generate(input, output, iteration, scale, direction, patch_mode, range, threads, Solver_Type(solver),
+             Solver_Type(reference), seed, size_t(budget) << 20,
+             levels, band, compare != 0, pin_band, Seam_Engine(seam_engine),
+             size_t(canvas_budget) << 20, checkpoint, period, &bundle);
 
     // show/save the result
 
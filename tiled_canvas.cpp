@@ -0,0 +1,340 @@
+//
+// Labels and colors of the montage canvas, by tiles allocated on their first write and spilled to a scratch file
+//
+
+#include <cstring>
+#include <unistd.h>
+#include "tiled_canvas.h"
+
+// Allocate the data of a tile
+static shared_ptr<uchar> new_tile(size_t bytes) {
+    return shared_ptr<uchar>(new uchar[bytes], default_delete<uchar[]>());
+}
+
+bool TileSnapshot::read(int k, uchar *out) const {
+    if (data[k])
+        memcpy(out, data[k].get(), bytes);
+    else if (mapped[k])
+        memcpy(out, mapped[k], bytes);
+    else if (slot[k] >= 0)
+        CV_Assert(pread(fileno(scratch.get()), out, bytes, off_t(slot[k])) == ssize_t(bytes));
+    else
+        return false;
+    return true;
+}
+
+void TileSnapshot::select(const vector<int> &tiles, TileSnapshot &out) const {
+    CV_Assert(index.empty());
+    out.rows = rows;
+    out.cols = cols;
+    out.shift = shift;
+    out.bytes = bytes;
+    out.index = tiles;
+    out.data.clear();
+    out.slot.clear();
+    out.mapped.clear();
+    out.stamp.clear();
+    for (int t : tiles) {
+        out.data.push_back(data[t]);
+        out.slot.push_back(slot[t]);
+        out.mapped.push_back(mapped[t]);
+        out.stamp.push_back(stamp.empty() ? 0 : stamp[t]);
+    }
+    out.scratch = scratch;
+    out.mapping = mapping;
+}
+
+size_t TileSnapshot::memory() const {
+    size_t held = 0;
+    for (const shared_ptr<uchar> &d : data)
+        if (d)
+            held += bytes;
+    return held;
+}
+
+TiledCanvas::TiledCanvas(int rows, int cols, int shift): rows(rows), cols(cols), shift(shift), side(1 << shift) {
+    tiles_x = (cols + side - 1) >> shift;
+    int count = tiles_x * ((rows + side - 1) >> shift);
+    bytes = size_t(side) * side * (sizeof(int) + sizeof(Vec3b));
+
+    blank.assign(bytes, 0);
+    fill((int *)blank.data(), (int *)blank.data() + side * side, -1);
+    tiles.resize(size_t(count));
+    labels.resize(size_t(count));
+    colors.resize(size_t(count));
+    for (int t = 0; t < count; t++)
+        point(t, blank.data());
+}
+
+void TiledCanvas::point(int t, const uchar *data) const {
+    labels[t] = (int *)data;
+    colors[t] = (Vec3b *)(data + size_t(side) * side * sizeof(int));
+}
+
+void TiledCanvas::set_budget(size_t bytes) {
+    budget = bytes;
+    spill();
+}
+
+void TiledCanvas::attach(int t) const {
+    Tile &tile = tiles[t];
+    point(t, tile.data.get());
+    tile.used = lru.insert(lru.end(), t);
+    resident += bytes;
+    if (tile.locks > 0)
+        locked += bytes;
+    peak_locked = max(peak_locked, locked);
+    spill(t);
+    peak = max(peak, resident);
+}
+
+void TiledCanvas::load(int t) const {
+    Tile &tile = tiles[t];
+    tile.data = new_tile(bytes);
+    CV_Assert(fseeko(scratch.get(), off_t(tile.slot), SEEK_SET) == 0);
+    CV_Assert(fread(tile.data.get(), bytes, 1, scratch.get()) == 1);
+    attach(t);
+}
+
+void TiledCanvas::spill(int keep) const {
+    auto it = lru.begin();
+    while (budget > 0 && resident > budget && it != lru.end()) {
+        int t = *it;
+        Tile &tile = tiles[t];
+        if (tile.locks > 0 || t == keep) {
+            ++it;
+            continue;
+        }
+
+        // a tile keeps its slot in the file once it has one
+
+        if (!scratch) {
+            scratch.reset(tmpfile(), fclose);
+            CV_Assert(scratch);
+        }
+        if (tile.slot < 0 || tile.frozen) {
+            tile.frozen = false;
+            tile.slot = end;
+            end += (long long)bytes;
+        }
+        CV_Assert(fseeko(scratch.get(), off_t(tile.slot), SEEK_SET) == 0);
+        CV_Assert(fwrite(tile.data.get(), bytes, 1, scratch.get()) == 1);
+        spills++;
+
+        tile.data.reset();
+        labels[t] = NULL;
+        colors[t] = NULL;
+        it = lru.erase(it);
+        resident -= bytes;
+    }
+}
+
+void TiledCanvas::set(int row, int col, int label, const Vec3b &color) {
+    int t = tile(row, col);
+    Tile &tile = tiles[t];
+    if (!tile.data && tile.written) {
+        load(t);
+    } else if (!tile.data) {
+        tile.data = new_tile(bytes);
+        memcpy(tile.data.get(), tile.mapped ? tile.mapped : blank.data(), bytes);
+        tile.mapped = NULL;
+        tile.written = true;
+        attach(t);
+    } else if (tile.data.use_count() > 1) {
+        shared_ptr<uchar> copy = new_tile(bytes); // a snapshot still reads the previous data
+        memcpy(copy.get(), tile.data.get(), bytes);
+        tile.data = copy;
+        point(t, copy.get());
+    }
+    int i = cell(row, col);
+    labels[t][i] = label;
+    colors[t][i] = color;
+    tile.stamp = ++stamps;
+}
+
+void TiledCanvas::lock(Rect area) const {
+    area = area & Rect(0, 0, cols, rows);
+    if (area.area() == 0)
+        return;
+    for (int y = area.y >> shift; y <= (area.y + area.height - 1) >> shift; y++)
+        for (int x = area.x >> shift; x <= (area.x + area.width - 1) >> shift; x++) {
+            int t = y * tiles_x + x;
+            Tile &tile = tiles[t];
+            tile.locks++;
+            if (tile.data) {
+                lru.splice(lru.end(), lru, tile.used);
+                if (tile.locks == 1)
+                    locked += bytes;
+                peak_locked = max(peak_locked, locked);
+            } else if (tile.written) {
+                load(t);
+            }
+        }
+}
+
+void TiledCanvas::unlock(Rect area) const {
+    area = area & Rect(0, 0, cols, rows);
+    if (area.area() == 0)
+        return;
+    for (int y = area.y >> shift; y <= (area.y + area.height - 1) >> shift; y++)
+        for (int x = area.x >> shift; x <= (area.x + area.width - 1) >> shift; x++) {
+            Tile &tile = tiles[y * tiles_x + x];
+            if (--tile.locks == 0 && tile.data)
+                locked -= bytes;
+        }
+    spill();
+}
+
+void TiledCanvas::copy_labels(Rect area, Mat &out) const {
+    out.create(area.height, area.width, CV_32S);
+    for (int row = area.y; row < area.y + area.height; row++)
+        for (int col = area.x; col < area.x + area.width; col = ((col >> shift) + 1) << shift) {
+            int n = min(((col >> shift) + 1) << shift, area.x + area.width) - col;
+            memcpy(out.ptr<int>(row - area.y) + col - area.x, labels[tile(row, col)] + cell(row, col),
+                   n * sizeof(int));
+        }
+}
+
+void TiledCanvas::copy_colors(Rect area, Mat &out) const {
+    out.create(area.height, area.width, CV_8UC3);
+    for (int row = area.y; row < area.y + area.height; row++)
+        for (int col = area.x; col < area.x + area.width; col = ((col >> shift) + 1) << shift) {
+            int n = min(((col >> shift) + 1) << shift, area.x + area.width) - col;
+            memcpy(out.ptr<Vec3b>(row - area.y) + col - area.x, colors[tile(row, col)] + cell(row, col),
+                   n * sizeof(Vec3b));
+        }
+}
+
+void TiledCanvas::reset() {
+    for (int t = 0; t < int(tiles.size()); t++) {
+        tiles[t] = Tile();
+        point(t, blank.data());
+    }
+    lru.clear();
+    resident = 0;
+    locked = 0;
+    mapping.reset();
+
+    // the slots of the file are given again, to a new file if a snapshot may still read the current one
+
+    if (scratch.use_count() > 1)
+        scratch.reset();
+    end = 0;
+}
+
+void TiledCanvas::snapshot(TileSnapshot &s) const {
+    size_t count = tiles.size();
+    s.rows = rows;
+    s.cols = cols;
+    s.shift = shift;
+    s.bytes = bytes;
+    s.index.clear();
+    s.data.assign(count, shared_ptr<uchar>());
+    s.slot.assign(count, -1);
+    s.mapped.assign(count, NULL);
+    s.stamp.assign(count, 0);
+    for (size_t t = 0; t < count; t++) {
+        Tile &tile = tiles[t];
+        if (tile.data) {
+            s.data[t] = tile.data;
+        } else if (tile.written) {
+            s.slot[t] = tile.slot;
+            tile.frozen = true;
+        } else {
+            s.mapped[t] = tile.mapped;
+        }
+        s.stamp[t] = tile.stamp;
+    }
+    if (scratch)
+        CV_Assert(fflush(scratch.get()) == 0);
+    s.scratch = scratch;
+    s.mapping = mapping;
+}
+
+void TiledCanvas::snapshot(TileSnapshot &s, const vector<int> &index) const {
+    TileSnapshot whole;
+    snapshot(whole);
+    whole.select(index, s);
+}
+
+/*
+ * A snapshot of some tiles only replaces them, their pixels are shared when they are resident in s and read otherwise,
+ * since the scratch file or the mapping of s may not be the ones of the canvas
+ */
+void TiledCanvas::restore(const TileSnapshot &s) {
+    if (!s.index.empty()) {
+        CV_Assert(s.rows == rows && s.cols == cols && s.shift == shift);
+        for (size_t k = 0; k < s.index.size(); k++) {
+            int t = s.index[k];
+            drop(t);
+            Tile &tile = tiles[t];
+            shared_ptr<uchar> data = s.data[k];
+            if (!data) {
+                data = new_tile(bytes);
+                if (!s.read(int(k), data.get()))
+                    data.reset();
+            }
+            if (data) {
+                tile.data = data;
+                tile.written = true;
+                attach(t);
+            }
+            tile.stamp = s.stamp[k];
+        }
+        return;
+    }
+
+    CV_Assert(s.rows == rows && s.cols == cols && fits(s));
+    reset();
+    mapping = s.mapping;
+
+    // the slots of s are left as they are for the snapshots which read them, the next spills go after them
+
+    if (s.scratch) {
+        scratch = s.scratch;
+        CV_Assert(fseeko(scratch.get(), 0, SEEK_END) == 0);
+        end = (long long)ftello(scratch.get());
+    }
+    for (int t = 0; t < int(tiles.size()); t++) {
+        Tile &tile = tiles[t];
+        if (s.data[t]) {
+            tile.data = s.data[t];
+            tile.written = true;
+            attach(t);
+        } else if (s.slot[t] >= 0) {
+            tile.slot = s.slot[t];
+            tile.written = true;
+            tile.frozen = true;
+            labels[t] = NULL;
+            colors[t] = NULL;
+        } else if (s.mapped[t]) {
+            tile.mapped = s.mapped[t];
+            point(t, s.mapped[t]);
+        }
+        tile.stamp = s.stamp.empty() ? ++stamps : s.stamp[t]; // a checkpoint read back has no stamps
+    }
+}
+
+void TiledCanvas::drop(int t) {
+    Tile &tile = tiles[t];
+    if (tile.data) {
+        lru.erase(tile.used);
+        resident -= bytes;
+        if (tile.locks > 0)
+            locked -= bytes;
+    }
+    tile = Tile(); // a slot of the tile in the scratch file is not given again
+    point(t, blank.data());
+}
+
+void TiledCanvas::changed(const TileSnapshot &s, vector<int> &index) const {
+    CV_Assert(fits(s) && s.index.empty() && s.stamp.size() == tiles.size());
+    index.clear();
+    for (int t = 0; t < int(tiles.size()); t++)
+        if (tiles[t].stamp != s.stamp[t])
+            index.push_back(t);
+}
+
+Rect TiledCanvas::area(int t) const {
+    return Rect((t % tiles_x) << shift, (t / tiles_x) << shift, side, side) & Rect(0, 0, cols, rows);
+}
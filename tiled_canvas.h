@@ -0,0 +1,131 @@
+//
+// Labels and colors of the montage canvas, by tiles allocated on their first write and spilled to a scratch file
+//
+
+#ifndef TILED_CANVAS_H
+#define TILED_CANVAS_H
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <cstdio>
+#include <opencv2/core/core.hpp>
+#include "parallel.h"
+
+using namespace std;
+using namespace cv;
+
+// Tiles of a canvas at one point of its life, readable from another thread while the canvas goes on
+struct TileSnapshot {
+    int rows = 0, cols = 0, shift = 8;
+    size_t bytes = 0; // of a tile
+    vector<int> index; // of the tiles held when only some of them are, empty when every tile is
+    vector<shared_ptr<uchar> > data; // resident tiles, the canvas copies them before writing them again
+    vector<long long> slot; // offsets of the spilled tiles in the scratch file, which keeps them
+    vector<const uchar *> mapped; // tiles read from a mapped checkpoint
+    vector<unsigned long long> stamp; // of the last write of every tile, 0 for a tile never written
+    shared_ptr<FILE> scratch;
+    shared_ptr<uchar> mapping; // of the checkpoint
+
+    bool read(int k, uchar *out) const; // of the k-th tile held, false for a blank tile
+    void select(const vector<int> &tiles, TileSnapshot &out) const; // only some tiles of a snapshot of every tile
+    size_t memory() const; // bytes of the resident tiles held
+};
+
+/*
+ * A canvas of rows x cols pixels cut into square tiles of 2^shift pixels. A tile never written reads as a blank tile
+ * shared by all of them, label -1 and black. The written tiles stay resident until they hold more than budget bytes,
+ * then the least recently used ones which are not locked are written to a scratch file and freed, and read back on
+ * their next use. The locked tiles are never spilled, so the resident tiles can exceed the budget by those. The tiles of a loaded checkpoint are read from its mapping until they are written.
+ *
+ * label and color only follow pointers, several threads can read the locked tiles at once. The other calls load and
+ * spill tiles and are made from a single thread.
+ */
+class TiledCanvas {
+    struct Tile {
+        shared_ptr<uchar> data; // labels then colors, null when the tile is not resident
+        const uchar *mapped = NULL; // in the mapping of a checkpoint, until the tile is written
+        bool written = false;
+        long long slot = -1; // offset of the tile in the scratch file, -1 if it was never spilled
+        bool frozen = false; // a snapshot reads the slot, the next spill takes another one
+        unsigned long long stamp = 0; // of the last write, tiles with the same stamp hold the same pixels
+        int locks = 0;
+        list<int>::iterator used; // position in lru when resident
+    };
+
+    int rows = 0, cols = 0, shift = 8, side = 256, tiles_x = 0;
+    size_t bytes = 0; // of a tile
+    mutable vector<Tile> tiles;
+    mutable vector<int *> labels; // of every tile, the blank tile if it was never written, null if it is spilled
+    mutable vector<Vec3b *> colors;
+    vector<uchar> blank;
+    mutable list<int> lru; // resident written tiles, least recently used first
+    size_t budget = 0; // 0 for no limit
+    mutable size_t resident = 0, peak = 0;
+    mutable size_t locked = 0, peak_locked = 0; // bytes of the resident tiles which are locked
+    mutable shared_ptr<FILE> scratch;
+    shared_ptr<uchar> mapping;
+    mutable long long end = 0; // of the scratch file
+    mutable int spills = 0;
+    unsigned long long stamps = 0; // last stamp given to a write
+
+    inline int tile(int row, int col) const { return (row >> shift) * tiles_x + (col >> shift); }
+    inline int cell(int row, int col) const { return ((row & (side - 1)) << shift) | (col & (side - 1)); }
+    void point(int t, const uchar *data) const; // read the tile from data
+    void attach(int t) const; // register the data of a tile as resident
+    void load(int t) const; // read a spilled tile back
+    void spill(int keep = -1) const; // free tiles until the budget is met, except keep
+    void drop(int t); // back to a blank tile
+
+public:
+    TiledCanvas() {}
+    TiledCanvas(int rows, int cols, int shift = 8);
+    void set_budget(size_t bytes);
+
+    int label(int row, int col) const { return labels[tile(row, col)][cell(row, col)]; }
+    const Vec3b &color(int row, int col) const { return colors[tile(row, col)][cell(row, col)]; }
+    void set(int row, int col, int label, const Vec3b &color);
+
+    void lock(Rect area) const; // keep the tiles of area resident, until unlock
+    void unlock(Rect area) const;
+    void copy_labels(Rect area, Mat &out) const; // CV_32S, area must be locked
+    void copy_colors(Rect area, Mat &out) const; // CV_8UC3, area must be locked
+    template <typename F>
+    void scan(Rect area, const F &f) const; // f(row, col, n, labels, colors) on the runs of each row within a tile
+    void reset(); // back to blank tiles
+    void snapshot(TileSnapshot &s) const; // share the tiles with s, in constant time per tile
+    void snapshot(TileSnapshot &s, const vector<int> &index) const; // share only some tiles
+    void restore(const TileSnapshot &s); // share the tiles of s again, the canvas copies them before writing them
+    void changed(const TileSnapshot &s, vector<int> &index) const; // tiles written since s, a snapshot of every tile
+    bool fits(const TileSnapshot &s) const { return s.shift == shift && s.mapped.size() == tiles.size(); }
+    Rect area(int t) const; // pixels of a tile
+
+    size_t memory() const { return resident; }
+    size_t peak_memory() const { return peak; }
+    size_t peak_locked_memory() const { return peak_locked; } // the part of the resident tiles above the budget
+    int spilled() const { return spills; } // tiles written to the scratch file so far
+};
+
+/*
+ * The rows of area are visited by bands of one tile, which are locked while their rows are processed in parallel, so
+ * only a band of tiles has to be resident beyond the budget
+ */
+template <typename F>
+void TiledCanvas::scan(Rect area, const F &f) const {
+    area = area & Rect(0, 0, cols, rows);
+    for (int top = area.y; top < area.y + area.height; top = ((top >> shift) + 1) << shift) {
+        Rect band(area.x, top, area.width, min(((top >> shift) + 1) << shift, area.y + area.height) - top);
+        lock(band);
+        parallel_rows(band.height, [&](int r) {
+            int row = band.y + r;
+            for (int col = band.x; col < band.x + band.width; col = ((col >> shift) + 1) << shift) {
+                int n = min(((col >> shift) + 1) << shift, band.x + band.width) - col;
+                int t = tile(row, col), i = cell(row, col);
+                f(row, col, n, labels[t] + i, colors[t] + i);
+            }
+        });
+        unlock(band);
+    }
+}
+
+#endif //TILED_CANVAS_H
@@ -0,0 +1,68 @@
+//
+// Cache of the resized and rotated variants of the texture sample
+//
+
+#include <set>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "transform_cache.h"
+#include "parallel.h"
+
+TransformCache::TransformCache(const Mat &sample, size_t budget): sample(sample), budget(budget) {
+}
+
+Mat TransformCache::transform(Size size, int rotation) const {
+    Mat tmp;
+    resize(sample, tmp, size);
+
+    Point2f pc(tmp.cols / 2.0f, tmp.rows / 2.0f);
+    Mat r = getRotationMatrix2D(pc, rotation, 1.0);
+    warpAffine(tmp, tmp, r, tmp.size());
+    return tmp;
+}
+
+void TransformCache::insert(const Key &key, const Mat &image) {
+    uses.push_front(key);
+    entries[key] = Entry{image, uses.begin()};
+    bytes += image.total() * image.elemSize();
+
+    // evict the least recently used variants, but always keep the new one
+
+    while (bytes > budget && uses.size() > 1) {
+        auto last = entries.find(uses.back());
+        bytes -= last->second.image.total() * last->second.image.elemSize();
+        entries.erase(last);
+        uses.pop_back();
+    }
+}
+
+Mat TransformCache::get(Size size, int rotation) {
+    Key key(size.width, size.height, rotation);
+    auto found = entries.find(key);
+    if (found != entries.end()) {
+        num_hit++;
+        uses.splice(uses.begin(), uses, found->second.use);
+        return found->second.image;
+    }
+
+    num_miss++;
+    Mat image = transform(size, rotation);
+    insert(key, image);
+    return image;
+}
+
+void TransformCache::prewarm(const vector<pair<Size,int>> &keys) {
+    vector<pair<Size,int>> missing;
+    set<Key> seen;
+    for (const pair<Size,int> &k : keys) {
+        Key key(k.first.width, k.first.height, k.second);
+        if (entries.find(key) == entries.end() && seen.insert(key).second)
+            missing.push_back(k);
+    }
+
+    vector<Mat> images(missing.size());
+    parallel_rows(int(missing.size()), [&](int i) {
+        images[i] = transform(missing[i].first, missing[i].second);
+    });
+    for (size_t i = 0; i < missing.size(); i++)
+        insert(Key(missing[i].first.width, missing[i].first.height, missing[i].second), images[i]);
+}
@@ -0,0 +1,53 @@
+//
+// Cache of the resized and rotated variants of the texture sample
+//
+
+#ifndef TRANSFORM_CACHE_H
+#define TRANSFORM_CACHE_H
+
+#include <list>
+#include <map>
+#include <tuple>
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+using namespace cv;
+
+/*
+ * The random placements resize the sample to a whole number of pixels and rotate it by a whole number of degrees, so a
+ * variant is keyed by its size and angle and the cached one is exactly what a new transform would give. The least
+ * recently used variants are dropped once their total size exceeds the budget; a dropped variant stays alive as long
+ * as a photo of the montage refers to it.
+ */
+class TransformCache {
+public:
+    TransformCache(const Mat &sample, size_t budget);
+
+    Mat get(Size size, int rotation);
+    void prewarm(const vector<pair<Size,int>> &keys); // transforms the missing variants in parallel
+
+    const Mat &original() const { return sample; }
+    size_t capacity() const { return budget; }
+    size_t hits() const { return num_hit; }
+    size_t misses() const { return num_miss; }
+    double hit_rate() const { return num_hit + num_miss > 0 ? double(num_hit) / (num_hit + num_miss) : 0; }
+
+private:
+    typedef tuple<int,int,int> Key; // width, height, rotation
+
+    struct Entry {
+        Mat image;
+        list<Key>::iterator use;
+    };
+
+    Mat sample;
+    size_t budget, bytes = 0;
+    size_t num_hit = 0, num_miss = 0;
+    map<Key, Entry> entries;
+    list<Key> uses; // most recent first
+
+    Mat transform(Size size, int rotation) const;
+    void insert(const Key &key, const Mat &image);
+};
+
+#endif //TRANSFORM_CACHE_H